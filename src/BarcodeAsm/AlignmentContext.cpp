@@ -0,0 +1,33 @@
+#include "AlignmentContext.h"
+
+AlignmentContext::AlignmentContext() {}
+
+AlignmentContext::~AlignmentContext() {
+  for (mm_tbuf_t *b : m_buffers)
+    mm_tbuf_destroy(b);
+}
+
+mm_tbuf_t *AlignmentContext::buffer(size_t i) {
+  while (m_buffers.size() <= i)
+    m_buffers.push_back(mm_tbuf_init());
+  return m_buffers[i];
+}
+
+std::string &AlignmentContext::referenceBuffer() { return m_reference; }
+
+void AlignmentContext::appendCigar(const mm_extra_t *p, std::string &out,
+                                   bool swap_indels, bool reverse) {
+  char digits[16];
+  for (uint32_t i = 0; i < p->n_cigar; ++i) {
+    uint32_t c = p->cigar[reverse ? p->n_cigar - 1 - i : i];
+    int op = c & 0xf;
+    if (swap_indels && (op == 1 || op == 2))
+      op = 3 - op; // I <-> D
+    int n = 0;
+    for (uint32_t len = c >> 4; len > 0 || n == 0; len /= 10)
+      digits[n++] = '0' + len % 10;
+    while (n > 0)
+      out.push_back(digits[--n]);
+    out.push_back("MIDNSH"[op]);
+  }
+}
@@ -0,0 +1,42 @@
+#ifndef ALIGNMENT_CONTEXT_H
+#define ALIGNMENT_CONTEXT_H
+
+#include "minimap2/minimap.h"
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+class AlignmentContext {
+  /* minimap2 thread buffers of one worker, and the copy of the reference of
+     its window, kept for the whole run and reused by all the alignments of
+     its windows. A context is only used by
+     the thread of its worker, except for the extra buffers it hands out to
+     the helper threads of a window.
+  */
+
+public:
+  AlignmentContext();
+  ~AlignmentContext();
+  AlignmentContext(const AlignmentContext &) = delete;
+  AlignmentContext &operator=(const AlignmentContext &) = delete;
+
+  // The i-th buffer, created on first use. Buffers must be taken by the
+  // owning thread before they are handed out.
+  mm_tbuf_t *buffer(size_t i = 0);
+
+  // Appends the CIGAR of a hit, like 10M2I5M. With query and target
+  // swapped, insertions become deletions, and reverse strand alignments
+  // are also read from the other end.
+  static void appendCigar(const mm_extra_t *p, std::string &out,
+                          bool swap_indels = false, bool reverse = false);
+
+  // reference sequence of the window being aligned
+  std::string &referenceBuffer();
+
+private:
+  std::vector<mm_tbuf_t *> m_buffers;
+  std::string m_reference;
+};
+
+#endif
@@ -0,0 +1,186 @@
+#include "BandedAligner.h"
+#include "minimap2/ksw2.h"
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+
+namespace {
+uint8_t baseCode(char c) {
+  switch (c) {
+  case 'A': case 'a': return 0;
+  case 'C': case 'c': return 1;
+  case 'G': case 'g': return 2;
+  case 'T': case 't': return 3;
+  default: return 4;
+  }
+}
+
+// ksw2 takes 8 bit gap costs. minimap2 passes its int costs through the
+// same conversion, which keeps the low byte (q2=300 becomes 44), so both
+// backends score gaps alike.
+int8_t gapCost(int cost) { return (int8_t)cost; }
+} // namespace
+
+BandedAligner::BandedAligner(const std::string &target, int k, int match, int mismatch,
+                             int q, int e, int q2, int e2, int bandwidth, int zdrop,
+                             int end_bonus)
+    : m_k(std::min(k, 16)), m_match(match), m_q(gapCost(q)), m_e(gapCost(e)),
+      m_q2(gapCost(q2)), m_e2(gapCost(e2)), m_bandwidth(bandwidth), m_zdrop(zdrop),
+      m_end_bonus(end_bonus) {
+  // ambiguous bases score -1, like in minimap2
+  for (int i = 0; i < 5; i++)
+    for (int j = 0; j < 5; j++)
+      m_mat[i * 5 + j] = i == 4 || j == 4 ? -1 : i == j ? match : -mismatch;
+
+  m_target.resize(target.size());
+  for (size_t i = 0; i < target.size(); i++)
+    m_target[i] = baseCode(target[i]);
+
+  uint32_t mask = m_k < 16 ? (1U << (2 * m_k)) - 1 : 0xffffffffU;
+  uint32_t kmer = 0;
+  int valid = 0;
+  for (size_t i = 0; i < m_target.size(); i++) {
+    if (m_target[i] > 3) {
+      valid = 0;
+      continue;
+    }
+    kmer = ((kmer << 2) | m_target[i]) & mask;
+    if (++valid < m_k)
+      continue;
+    int32_t pos = i + 1 - m_k;
+    auto inserted = m_kmers.emplace(kmer, pos);
+    if (!inserted.second)
+      inserted.first->second = -1;
+  }
+}
+
+bool BandedAligner::align(const std::string &query, int min_score, BandedHit &hit) const {
+  std::vector<uint8_t> fwd(query.size()), rev(query.size());
+  for (size_t i = 0; i < query.size(); i++) {
+    fwd[i] = baseCode(query[i]);
+    rev[query.size() - 1 - i] = fwd[i] > 3 ? 4 : 3 - fwd[i];
+  }
+
+  BandedHit fwd_hit, rev_hit;
+  bool fwd_found = alignStrand(fwd, fwd_hit);
+  bool rev_found = alignStrand(rev, rev_hit);
+  if (rev_found && (!fwd_found || rev_hit.score > fwd_hit.score)) {
+    // query coordinates on the forward strand
+    int qs = query.size() - rev_hit.qe;
+    rev_hit.qe = query.size() - rev_hit.qs;
+    rev_hit.qs = qs;
+    rev_hit.rev = true;
+    hit = rev_hit;
+  } else if (fwd_found) {
+    fwd_hit.rev = false;
+    hit = fwd_hit;
+  } else {
+    return false;
+  }
+  return hit.score >= min_score;
+}
+
+bool BandedAligner::alignStrand(const std::vector<uint8_t> &query, BandedHit &hit) const {
+  // Seeds vote for their diagonal, in bands of 32 diagonals. The first seed
+  // of the band with the most votes anchors the alignment.
+  std::unordered_map<int32_t, std::pair<int, int32_t>> bands; // votes, first seed
+  uint32_t mask = m_k < 16 ? (1U << (2 * m_k)) - 1 : 0xffffffffU;
+  uint32_t kmer = 0;
+  int valid = 0;
+  for (size_t i = 0; i < query.size(); i++) {
+    if (query[i] > 3) {
+      valid = 0;
+      continue;
+    }
+    kmer = ((kmer << 2) | query[i]) & mask;
+    if (++valid < m_k)
+      continue;
+    auto it = m_kmers.find(kmer);
+    if (it == m_kmers.end() || it->second < 0)
+      continue;
+    int32_t qpos = i + 1 - m_k;
+    int32_t diagonal = it->second - qpos;
+    int32_t band = diagonal >= 0 ? diagonal / 32 : -((-diagonal + 31) / 32);
+    auto inserted = bands.emplace(band, std::make_pair(0, qpos));
+    inserted.first->second.first++;
+  }
+  if (bands.empty())
+    return false;
+
+  auto best = bands.begin();
+  for (auto it = bands.begin(); it != bands.end(); ++it)
+    if (it->second.first > best->second.first ||
+        (it->second.first == best->second.first && it->first < best->first))
+      best = it;
+  int32_t seed_q = best->second.second;
+  uint32_t seed_kmer = 0;
+  for (int i = 0; i < m_k; i++)
+    seed_kmer = (seed_kmer << 2) | query[seed_q + i];
+  int32_t seed_t = m_kmers.at(seed_kmer);
+
+  // left of the seed, extended backwards
+  std::vector<uint8_t> left_q(query.rend() - seed_q, query.rend());
+  std::vector<uint8_t> left_t(m_target.rend() - seed_t, m_target.rend());
+  std::vector<uint32_t> left_cigar;
+  int left_qlen, left_tlen;
+  int left_score = extend(left_q, left_t, left_cigar, left_qlen, left_tlen);
+
+  // right of the seed
+  std::vector<uint8_t> right_q(query.begin() + seed_q + m_k, query.end());
+  std::vector<uint8_t> right_t(m_target.begin() + seed_t + m_k, m_target.end());
+  std::vector<uint32_t> right_cigar;
+  int right_qlen, right_tlen;
+  int right_score = extend(right_q, right_t, right_cigar, right_qlen, right_tlen);
+
+  hit.cigar.clear();
+  for (auto c = left_cigar.rbegin(); c != left_cigar.rend(); ++c)
+    appendOp(hit.cigar, *c >> 4, *c & 0xf);
+  appendOp(hit.cigar, m_k, 0);
+  for (uint32_t c : right_cigar)
+    appendOp(hit.cigar, c >> 4, c & 0xf);
+
+  hit.qs = seed_q - left_qlen;
+  hit.qe = seed_q + m_k + right_qlen;
+  hit.ts = seed_t - left_tlen;
+  hit.te = seed_t + m_k + right_tlen;
+  hit.score = left_score + m_k * m_match + right_score;
+  return true;
+}
+
+int BandedAligner::extend(const std::vector<uint8_t> &query, const std::vector<uint8_t> &target,
+                          std::vector<uint32_t> &cigar, int &qlen, int &tlen) const {
+  qlen = tlen = 0;
+  if (query.empty() || target.empty())
+    return 0;
+
+  ksw_extz_t ez;
+  memset(&ez, 0, sizeof(ez));
+  ksw_extd2_sse(NULL, query.size(), query.data(), target.size(), target.data(), 5, m_mat,
+                m_q, m_e, m_q2, m_e2, m_bandwidth, m_zdrop, m_end_bonus,
+                KSW_EZ_EXTZ_ONLY, &ez);
+
+  // The alignment runs to the end of the query when that beats the best
+  // score with the end bonus, and stops at the best score otherwise.
+  int score = 0;
+  if (ez.reach_end) {
+    qlen = query.size();
+    tlen = ez.mqe_t + 1;
+    score = ez.mqe;
+  } else if (ez.max_q >= 0 && ez.max_t >= 0) {
+    qlen = ez.max_q + 1;
+    tlen = ez.max_t + 1;
+    score = ez.max;
+  }
+  cigar.assign(ez.cigar, ez.cigar + ez.n_cigar);
+  free(ez.cigar);
+  return score;
+}
+
+void BandedAligner::appendOp(std::vector<uint32_t> &cigar, uint32_t len, uint32_t op) {
+  if (len == 0)
+    return;
+  if (!cigar.empty() && (cigar.back() & 0xf) == op)
+    cigar.back() += len << 4;
+  else
+    cigar.push_back(len << 4 | op);
+}
@@ -0,0 +1,54 @@
+#ifndef BANDED_ALIGNER_H
+#define BANDED_ALIGNER_H
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+struct BandedHit {
+  int qs, qe;   // on the forward strand of the query
+  int ts, te;
+  bool rev;
+  int score;
+  std::vector<uint32_t> cigar; // minimap2 encoding, length << 4 | op
+};
+
+class BandedAligner {
+  /* Aligns sequences directly to one short target, without an index. A
+     unique k-mer shared with the target anchors the alignment, which is
+     then extended on both sides with the SSE dual affine gap extension of
+     ksw2, the aligner minimap2 uses for its base level alignments. Both
+     strands are tried and the best scoring one is kept.
+  */
+
+public:
+  BandedAligner(const std::string &target, int k, int match, int mismatch,
+                int q, int e, int q2, int e2, int bandwidth, int zdrop, int end_bonus);
+
+  // False if no alignment reaches min_score.
+  bool align(const std::string &query, int min_score, BandedHit &hit) const;
+
+private:
+  // Anchors the strand of the query at its best seed.
+  bool alignStrand(const std::vector<uint8_t> &query, BandedHit &hit) const;
+  // Extends from the start of both sequences, and returns the score. The
+  // lengths of the aligned parts are written to qlen and tlen.
+  int extend(const std::vector<uint8_t> &query, const std::vector<uint8_t> &target,
+             std::vector<uint32_t> &cigar, int &qlen, int &tlen) const;
+  static void appendOp(std::vector<uint32_t> &cigar, uint32_t len, uint32_t op);
+
+  int m_k;
+  std::vector<uint8_t> m_target;  // 0-3, 4 for ambiguous bases
+  // position of the k-mers of the target, -1 for repeated ones
+  std::unordered_map<uint32_t, int32_t> m_kmers;
+
+  int8_t m_mat[25];
+  int m_match;
+  int8_t m_q, m_e, m_q2, m_e2;
+  int m_bandwidth;
+  int m_zdrop;
+  int m_end_bonus;
+};
+
+#endif
@@ -1,20 +1,31 @@
+#include "BarcodeRouter.h"
 #include "BxBamWalker.h"
+#include "HtsBamReader.h"
 #include "CTPL/ctpl_stl.h"
 #include "ContigAlignment.h"
 #include "LocalAlignment.h"
 #include "LocalAssemblyWindow.h"
+#include "MemoryBudget.h"
+#include "ReferenceGenome.h"
 #include "RegionFileReader.h"
+#include "WindowOutputs.h"
+#include "WindowGroup.h"
+#include "WindowScheduler.h"
+#include "WindowWriter.h"
 #include "SeqLib/BamRecord.h"
-#include "SeqLib/RefGenome.h"
 #include "SeqLib/UnalignedSequence.h"
 #include <ContigAlignment.h>
 #include <algorithm>
+#include <cctype>
 #include <cstdlib>
 #include <fstream>
+#include <getopt.h>
 #include <future>
 #include <iostream>
 #include <iterator>
+#include <memory>
 #include <mutex>
+#include <sstream>
 #include <stdexcept>
 #include <unistd.h>
 #include <vector>
@@ -36,18 +47,154 @@ bool write_gfa = false;
 std::string detect_seqs_fa;
 int poor_alignment_max_mapq = 10;
 int min_cnt = 8;
+size_t cache_size = 0;
+bool inverted = false;
+std::string bx_index_path;
+int hts_threads = 0;
+int fermi_threads = 1;
+std::string stats_path;
+std::string prior_stats_path;
+bool bed_order = false;
+int group_distance = -1;
+bool kmer_filter = false;
+bool kmer_filter_reference = false;
+int kmer_size = 25;
+int kmer_min_shared = 2;
+int kmer_rounds = 2;
+size_t max_mem = 0;
+bool resume = false;
+int shard = 1;
+int num_shards = 1;
+bool mate_graph = false;
+int map_threads = 1;
+std::string ref_index_path;
+size_t ref_flank = 0;
+LocalAligner aligner = ALIGNER_MINIMAP2;
 } // namespace opt
 
+// options that only have a long form
+enum { OPT_CACHE_SIZE = 256, OPT_INVERTED, OPT_BX_INDEX, OPT_HTS_THREADS, OPT_FERMI_THREADS, OPT_STATS,
+       OPT_PRIOR_STATS, OPT_BED_ORDER, OPT_GROUP_DISTANCE,
+       OPT_KMER_FILTER, OPT_KMER_FILTER_REF, OPT_KMER_SIZE, OPT_KMER_MIN_SHARED,
+       OPT_KMER_ROUNDS, OPT_MAX_MEM, OPT_RESUME, OPT_SHARD,
+       OPT_MATE_GRAPH, OPT_MAP_THREADS, OPT_REF_INDEX, OPT_REF_FLANK,
+       OPT_ALIGNER };
+
+static const struct option long_options[] = {
+  {"cache-size", required_argument, NULL, OPT_CACHE_SIZE},
+  {"inverted", no_argument, NULL, OPT_INVERTED},
+  {"bx-index", required_argument, NULL, OPT_BX_INDEX},
+  {"hts-threads", required_argument, NULL, OPT_HTS_THREADS},
+  {"fermi-threads", required_argument, NULL, OPT_FERMI_THREADS},
+  {"stats", required_argument, NULL, OPT_STATS},
+  {"prior-stats", required_argument, NULL, OPT_PRIOR_STATS},
+  {"bed-order", no_argument, NULL, OPT_BED_ORDER},
+  {"group-distance", required_argument, NULL, OPT_GROUP_DISTANCE},
+  {"kmer-filter", no_argument, NULL, OPT_KMER_FILTER},
+  {"kmer-filter-ref", no_argument, NULL, OPT_KMER_FILTER_REF},
+  {"kmer-size", required_argument, NULL, OPT_KMER_SIZE},
+  {"kmer-min-shared", required_argument, NULL, OPT_KMER_MIN_SHARED},
+  {"kmer-rounds", required_argument, NULL, OPT_KMER_ROUNDS},
+  {"max-mem", required_argument, NULL, OPT_MAX_MEM},
+  {"resume", no_argument, NULL, OPT_RESUME},
+  {"shard", required_argument, NULL, OPT_SHARD},
+  {"mate-graph", no_argument, NULL, OPT_MATE_GRAPH},
+  {"map-threads", required_argument, NULL, OPT_MAP_THREADS},
+  {"ref-index", required_argument, NULL, OPT_REF_INDEX},
+  {"ref-flank", required_argument, NULL, OPT_REF_FLANK},
+  {"aligner", required_argument, NULL, OPT_ALIGNER},
+  {NULL, 0, NULL, 0}
+};
+
+// Parses sizes like 512M or 48G into bytes.
+static size_t parseByteSize(const std::string &s) {
+  size_t end;
+  double value = std::stod(s, &end);
+  switch (end < s.size() ? toupper(s[end]) : 'B') {
+  case 'K': value *= 1024.0; break;
+  case 'M': value *= 1024.0 * 1024.0; break;
+  case 'G': value *= 1024.0 * 1024.0 * 1024.0; break;
+  case 'T': value *= 1024.0 * 1024.0 * 1024.0 * 1024.0; break;
+  case 'B': break;
+  default: throw std::invalid_argument("Unknown size suffix in " + s);
+  }
+  return (size_t)value;
+}
+
+// BarcodeAsm index [-t threads] [-o out.bxi] <bam>
+static int runIndex(int argc, char **argv) {
+  int num_threads = 1;
+  std::string index_path;
+  int c;
+  while ((c = getopt(argc, argv, "t:o:")) != -1)
+    switch (c) {
+    case 't':
+      num_threads = std::stoi(optarg);
+      break;
+    case 'o':
+      index_path = optarg;
+      break;
+    default:
+      abort();
+    }
+
+  if (optind >= argc) {
+    std::cerr << "Usage: BarcodeAsm index [-t threads] [-o out.bxi] <bam>" << std::endl;
+    return 1;
+  }
+  std::string bam_path = argv[optind];
+  if (index_path.empty())
+    index_path = BxSidecarIndex::defaultPath(bam_path);
+
+  BxSidecarIndex::build(bam_path, index_path, num_threads);
+  return 0;
+}
+
+// BarcodeAsm merge [-o out_dir] [--allow-partial] <shard_dir>...
+static int runMerge(int argc, char **argv) {
+  static const struct option merge_options[] = {
+    {"allow-partial", no_argument, NULL, 'p'},
+    {NULL, 0, NULL, 0}
+  };
+  std::string out_dir;
+  bool allow_partial = false;
+  int c;
+  while ((c = getopt_long(argc, argv, "o:p", merge_options, NULL)) != -1)
+    switch (c) {
+    case 'o':
+      out_dir = optarg;
+      break;
+    case 'p':
+      allow_partial = true;
+      break;
+    default:
+      abort();
+    }
+
+  if (optind >= argc) {
+    std::cerr << "Usage: BarcodeAsm merge [-o out_dir] [--allow-partial] <shard_dir>..."
+              << std::endl;
+    return 1;
+  }
+  std::vector<std::string> shard_dirs(argv + optind, argv + argc);
+  return WindowOutputs::mergeShards(shard_dirs, out_dir, allow_partial) ? 0 : 1;
+}
+
 int main(int argc, char **argv) {
+  if (argc > 1 && std::string(argv[1]) == "index")
+    return runIndex(argc - 1, argv + 1);
+  if (argc > 1 && std::string(argv[1]) == "merge")
+    return runMerge(argc - 1, argv + 1);
+
   opterr = 0;
   int c;
-  while ((c = getopt(argc, argv, "k:q:GSsPat:b:B:r:g:o:F:")) != -1)
+  while ((c = getopt_long(argc, argv, "k:q:GSsPat:b:B:r:g:o:F:", long_options, NULL)) != -1)
     switch (c) {
     case 't':
         try {
             opt::num_threads = std::stoi(optarg);
         }
-        catch(std::invalid_argument){
+        catch(const std::invalid_argument &){
             std::cerr << "Number of threads -t must be integer!" << std::endl;
             return -1;
         }
@@ -91,6 +238,95 @@ int main(int argc, char **argv) {
     case 'F' :
       opt::detect_seqs_fa = optarg;
       break;
+    case OPT_CACHE_SIZE:
+      try {
+        opt::cache_size = parseByteSize(optarg);
+      }
+      catch (const std::invalid_argument &) {
+        std::cerr << "Cache size --cache-size must be a size like 4G!" << std::endl;
+        return -1;
+      }
+      break;
+    case OPT_INVERTED:
+      opt::inverted = true;
+      break;
+    case OPT_BX_INDEX:
+      opt::bx_index_path = optarg;
+      break;
+    case OPT_HTS_THREADS:
+      opt::hts_threads = std::stoi(optarg);
+      break;
+    case OPT_FERMI_THREADS:
+      opt::fermi_threads = std::max(1, std::stoi(optarg));
+      break;
+    case OPT_STATS:
+      opt::stats_path = optarg;
+      break;
+    case OPT_PRIOR_STATS:
+      opt::prior_stats_path = optarg;
+      break;
+    case OPT_BED_ORDER:
+      opt::bed_order = true;
+      break;
+    case OPT_GROUP_DISTANCE:
+      opt::group_distance = std::stoi(optarg);
+      break;
+    case OPT_KMER_FILTER:
+      opt::kmer_filter = true;
+      break;
+    case OPT_KMER_FILTER_REF:
+      opt::kmer_filter_reference = true;
+      break;
+    case OPT_KMER_SIZE:
+      opt::kmer_size = std::stoi(optarg);
+      break;
+    case OPT_KMER_MIN_SHARED:
+      opt::kmer_min_shared = std::stoi(optarg);
+      break;
+    case OPT_KMER_ROUNDS:
+      opt::kmer_rounds = std::stoi(optarg);
+      break;
+    case OPT_MAX_MEM:
+      try {
+        opt::max_mem = parseByteSize(optarg);
+      }
+      catch (const std::invalid_argument &) {
+        std::cerr << "Memory budget --max-mem must be a size like 48G!" << std::endl;
+        return -1;
+      }
+      break;
+    case OPT_RESUME:
+      opt::resume = true;
+      break;
+    case OPT_MATE_GRAPH:
+      opt::mate_graph = true;
+      break;
+    case OPT_MAP_THREADS:
+      opt::map_threads = std::max(1, std::stoi(optarg));
+      break;
+    case OPT_REF_INDEX:
+      opt::ref_index_path = optarg;
+      break;
+    case OPT_REF_FLANK:
+      opt::ref_flank = std::stoul(optarg);
+      break;
+    case OPT_ALIGNER:
+      if (std::string(optarg) == "minimap2")
+        opt::aligner = ALIGNER_MINIMAP2;
+      else if (std::string(optarg) == "banded")
+        opt::aligner = ALIGNER_BANDED;
+      else {
+        std::cerr << "Aligner --aligner must be minimap2 or banded!" << std::endl;
+        return -1;
+      }
+      break;
+    case OPT_SHARD:
+      if (sscanf(optarg, "%d/%d", &opt::shard, &opt::num_shards) != 2 ||
+          opt::shard < 1 || opt::shard > opt::num_shards) {
+        std::cerr << "Shard --shard must be i/N with i from 1 to N!" << std::endl;
+        return -1;
+      }
+      break;
     default:
       abort();
     }
@@ -102,6 +338,12 @@ int main(int argc, char **argv) {
   params.split_reads_by_phase = opt::split_reads_by_phase;
   params.write_gfa = opt::write_gfa;
   params.min_cnt = opt::min_cnt;
+  params.fermi_threads = opt::fermi_threads;
+  params.kmer_filter = opt::kmer_filter;
+  params.kmer_filter_reference = opt::kmer_filter_reference;
+  params.kmer_size = opt::kmer_size;
+  params.kmer_min_shared = opt::kmer_min_shared;
+  params.kmer_rounds = opt::kmer_rounds;
 
   std::cerr << "Param r: " << opt::regions_path << std::endl
             << "Param b: " << opt::bam_path << std::endl
@@ -114,7 +356,33 @@ int main(int argc, char **argv) {
             << "Param q: " << opt::poor_alignment_max_mapq << std::endl
             << "Param k: " << opt::min_cnt << std::endl
             << "Param G: " << opt::write_gfa << std::endl
-            << "Param F: " << opt::detect_seqs_fa << std::endl;
+            << "Param F: " << opt::detect_seqs_fa << std::endl
+            << "Param cache-size: " << opt::cache_size << std::endl
+            << "Param inverted: " << opt::inverted << std::endl
+            << "Param bx-index: " << opt::bx_index_path << std::endl
+            << "Param hts-threads: " << opt::hts_threads << std::endl
+            << "Param fermi-threads: " << opt::fermi_threads << std::endl
+            << "Param stats: " << opt::stats_path << std::endl
+            << "Param prior-stats: " << opt::prior_stats_path << std::endl
+            << "Param bed-order: " << opt::bed_order << std::endl
+            << "Param group-distance: " << opt::group_distance << std::endl
+            << "Param kmer-filter: " << opt::kmer_filter << std::endl
+            << "Param kmer-filter-ref: " << opt::kmer_filter_reference << std::endl
+            << "Param kmer-size: " << opt::kmer_size << std::endl
+            << "Param kmer-min-shared: " << opt::kmer_min_shared << std::endl
+            << "Param kmer-rounds: " << opt::kmer_rounds << std::endl
+            << "Param max-mem: " << opt::max_mem << std::endl
+            << "Param resume: " << opt::resume << std::endl
+            << "Param shard: " << opt::shard << "/" << opt::num_shards << std::endl
+            << "Param mate-graph: " << opt::mate_graph << std::endl
+            << "Param map-threads: " << opt::map_threads << std::endl
+            << "Param ref-index: " << opt::ref_index_path << std::endl
+            << "Param ref-flank: " << opt::ref_flank << std::endl
+            << "Param aligner: " << (opt::aligner == ALIGNER_BANDED ? "banded" : "minimap2") << std::endl;
+
+  // with a barcode index, barcodes are read from the position sorted BAM
+  if(!opt::bx_index_path.empty() && opt::bx_bam_path.empty())
+      opt::bx_bam_path = opt::bam_path;
 
   // check if we have the basic inputs
   if(opt::regions_path.empty() || opt::bx_bam_path.empty() || opt::bam_path.empty()) {
@@ -122,11 +390,22 @@ int main(int argc, char **argv) {
       return 1;
   }
 
+  if(opt::aligner == ALIGNER_BANDED && !opt::ref_index_path.empty()) {
+      std::cerr << "--aligner banded aligns to the window, it cannot be used with --ref-index." << std::endl;
+      return 1;
+  }
+
+  if(opt::inverted && !opt::bx_index_path.empty()) {
+      std::cerr << "--inverted needs a barcode sorted BAM (-B), not --bx-index." << std::endl;
+      return 1;
+  }
+
   // Storage for thread pooled resources
   // These not be guarded by mutex, since they assigned to individual thread IDs
-  std::vector<SeqLib::BamReader*> bam_readers(opt::num_threads);
+  std::vector<HtsBamReader*> bam_readers(opt::num_threads);
   std::vector<BxBamWalker*> bx_bam_walkers(opt::num_threads);
-  std::vector<SeqLib::RefGenome*> ref_genomes(opt::num_threads);
+  // minimap2 buffers reused by all the windows of a thread
+  std::vector<std::unique_ptr<AlignmentContext>> align_contexts(opt::num_threads);
 
   // load sequences to be detected in contigs
   SeqLib::UnalignedSequenceVector detect_seqs;
@@ -136,23 +415,70 @@ int main(int argc, char **argv) {
       while(seq_fa.GetNextSequence(s))
           detect_seqs.push_back(s);
   }
+  // indexed once, and shared by all workers
+  DetectionLibrary detect_library = ContigAlignment::indexLibrary(detect_seqs);
+
+  // Contigs are aligned to the whole genome index, if any, instead of an
+  // index of each window
+  std::unique_ptr<ReferenceIndex> reference_index;
+  if (!opt::ref_index_path.empty()) {
+    reference_index.reset(new ReferenceIndex());
+    if (!reference_index->load(opt::ref_index_path, opt::num_threads)) {
+      std::cerr << "Could not load " << opt::ref_index_path << std::endl;
+      return 1;
+    }
+  }
+
+  // The barcode BAM header has one target per barcode. Parse it only once
+  // and share it between all barcode walkers. Likewise for a barcode index.
+  std::shared_ptr<const BxBarcodeDictionary> bx_dictionary;
+  std::shared_ptr<const BxSidecarIndex> bx_sidecar;
+  if (opt::bx_index_path.empty())
+    bx_dictionary = std::make_shared<const BxBarcodeDictionary>(opt::bx_bam_path);
+  else
+    bx_sidecar = std::make_shared<const BxSidecarIndex>(opt::bx_index_path);
+
+  // Barcode blocks cached across windows and threads
+  std::shared_ptr<BxReadCache> bx_cache;
+  if (opt::cache_size > 0)
+    bx_cache = std::make_shared<BxReadCache>(opt::cache_size);
+
+  // BGZF decompression pool shared by all BAM readers, so that inflating
+  // blocks overlaps with assembly and alignment in the workers
+  htsThreadPool hts_pool = {NULL, 0};
+  if (opt::hts_threads > 0)
+    hts_pool.pool = hts_tpool_init(opt::hts_threads);
+
+  // one reference genome, mapped in memory and shared by all threads
+  ReferenceGenome ref_genome;
+  bool load_ref = ref_genome.load(opt::reference_path);
+  std::cerr << "Loaded " << opt::reference_path << ": " << load_ref << std::endl;
+  if (!load_ref && (!reference_index || opt::kmer_filter_reference)) {
+    std::cerr << "Could not load the genome " << opt::reference_path << std::endl;
+    return 1;
+  }
 
-  // initialize pooled bam, bx_bam, and genome readers
+  // initialize pooled bam and bx_bam readers
   for(size_t i = 0; i < opt::num_threads; i++) {
-    // one reference genome reader for each thread
-    SeqLib::RefGenome *ref_genome = new SeqLib::RefGenome();
-    bool load_ref = ref_genome -> LoadIndex(opt::reference_path);
-    std::cerr << "Loaded " << opt::reference_path << ": " << load_ref << std::endl;
-    ref_genomes[i] = ref_genome;
 
     // one BamReader for each thread
-    SeqLib::BamReader *bam_reader = new SeqLib::BamReader();
-    bam_reader -> Open(opt::bam_path);
+    HtsBamReader *bam_reader = new HtsBamReader();
+    if (!bam_reader -> Open(opt::bam_path)) {
+      std::cerr << "Could not open " << opt::bam_path << std::endl;
+      return 1;
+    }
+    bam_reader -> setThreadPool(&hts_pool);
     bam_readers[i] = bam_reader;
 
     // and one BX_BamReader for each thread
-    BxBamWalker *bx_bam_walker = new BxBamWalker(opt::bx_bam_path, "0000", opt::weird_reads_only, opt::poor_alignment_max_mapq);
+    BxBamWalker *bx_bam_walker = bx_sidecar ?
+        new BxBamWalker(opt::bx_bam_path, bx_sidecar, "0000", opt::weird_reads_only, opt::poor_alignment_max_mapq) :
+        new BxBamWalker(opt::bx_bam_path, bx_dictionary, "0000", opt::weird_reads_only, opt::poor_alignment_max_mapq);
+    bx_bam_walker -> setReadCache(bx_cache);
+    bx_bam_walker -> setThreadPool(&hts_pool);
     bx_bam_walkers[i] = bx_bam_walker;
+
+    align_contexts[i].reset(new AlignmentContext());
   }
 
   // Thread pool to run all the regions
@@ -160,69 +486,363 @@ int main(int argc, char **argv) {
 
   // Regions to be locally assembled
   RegionFileReader region_reader(opt::regions_path, bam_readers[0]->Header());
+  SeqLib::GenomicRegionVector regions = region_reader.getRegions();
+  // Read the previous times before --stats, which may be the same file, is
+  // truncated.
+  WindowScheduler scheduler(*bam_readers[0]);
+  if (!opt::prior_stats_path.empty() && !scheduler.loadStats(opt::prior_stats_path))
+    std::cerr << "Could not read window times from " << opt::prior_stats_path << std::endl;
 
-  // file to write contig sequences in
-  std::ofstream fasta("contigs.fa");
-  std::mutex fasta_mutex;
-
-  // file to write TE hits in
-  std::ofstream hits("hits.tsv");
-  std::mutex hits_mutex;
-
-  // file to write alignments
-  std::ofstream alns("alignments.tsv");
-  std::mutex alns_mutex;
-  // output alignments
-  alns << LocalAlignment::getAlignmentHeader() << std::endl;
-
-  for (auto region : region_reader.getRegions()) {
-    std::string chrom = region.ChrName(bam_readers[0]->Header());
-    std::cerr << "Running " << chrom << " " << region.pos1 << " " << region.pos2 << std::endl;
-    auto future = thread_pool.push([region, &fasta, &fasta_mutex,
-                                    &alns, &alns_mutex,
-                                    &hits, &hits_mutex,
-                                    &params, &detect_seqs,
-                                    &ref_genomes, &bam_readers,
-                                    &bx_bam_walkers](int id) {
-
-      std::cerr << "ID " << id << std::endl;
-      LocalAssemblyWindow local_win(region, *bam_readers[id], *bx_bam_walkers[id], params);
+  // windows that fetch their reads together, each window alone by default
+  std::vector<RegionGroup> all_groups = region_reader.getGroups(opt::group_distance);
+
+  // With --shard, this process only runs the windows of its shard, and
+  // writes them to a directory of its own. The partition only depends on
+  // the inputs, so that every shard computes the same one.
+  std::vector<bool> in_shard(regions.size(), true);
+  std::string out_dir;
+  if (opt::num_shards > 1) {
+    std::vector<int> group_shards = scheduler.assignShards(regions, all_groups, opt::num_shards);
+    for (size_t g = 0; g < all_groups.size(); g++)
+      for (size_t w : all_groups[g].windows)
+        in_shard[w] = group_shards[g] == opt::shard - 1;
+    std::stringstream dir;
+    dir << "shard_" << opt::shard << "_of_" << opt::num_shards;
+    out_dir = dir.str();
+  }
+
+  // Contigs, hits and alignments, with the journal of completed windows
+  WindowOutputs outputs(out_dir, LocalAlignment::getAlignmentHeader(), opt::resume);
+  if (opt::num_shards > 1) {
+    // for merge to check that the shards are complete
+    std::vector<size_t> shard_windows;
+    for (size_t w = 0; w < regions.size(); w++)
+      if (in_shard[w])
+        shard_windows.push_back(w);
+    outputs.writeShardWindows(opt::shard, opt::num_shards, regions.size(), shard_windows);
+  }
+
+  // windows left to run, which are written in this order
+  std::vector<size_t> pending;
+  for (size_t w = 0; w < regions.size(); w++)
+    if (in_shard[w] && !outputs.isComplete(w))
+      pending.push_back(w);
+
+  std::vector<RegionGroup> groups;
+  for (RegionGroup &group : all_groups) {
+    // a resumed run skips the windows it already completed
+    RegionGroup left;
+    for (size_t w : group.windows) {
+      if (!in_shard[w] || outputs.isComplete(w))
+        continue;
+      const SeqLib::GenomicRegion &r = regions[w];
+      if (left.windows.empty())
+        left.span = SeqLib::GenomicRegion(r.chr, r.pos1, r.pos2);
+      left.span.pos1 = std::min(left.span.pos1, r.pos1);
+      left.span.pos2 = std::max(left.span.pos2, r.pos2);
+      left.windows.push_back(w);
+    }
+    if (!left.windows.empty())
+      groups.push_back(left);
+  }
+
+  // Most expensive windows first
+  std::vector<size_t> group_order(groups.size());
+  for (size_t g = 0; g < groups.size(); g++)
+    group_order[g] = g;
+  if (!opt::bed_order)
+    group_order = scheduler.order(regions, groups);
+
+  // file to write per window stage times and counts in
+  std::ofstream window_stats;
+  if (!opt::stats_path.empty()) {
+    // A resumed run keeps the lines of the windows it already completed,
+    // so that the file can still be used with --prior-stats.
+    bool has_header = false;
+    if (opt::resume) {
+      std::ifstream previous(opt::stats_path);
+      std::string line;
+      uint64_t bytes = 0, complete_bytes = 0;
+      while (std::getline(previous, line)) {
+        bytes += line.size() + 1;
+        // a line cut by the interruption has no newline
+        if (previous.eof())
+          break;
+        if (complete_bytes == 0)
+          has_header = line == WindowStats::header();
+        complete_bytes = bytes;
+      }
+      if (has_header && truncate(opt::stats_path.c_str(), complete_bytes) != 0)
+        has_header = false;
+    }
+    window_stats.open(opt::stats_path, has_header ? std::ios::app : std::ios::trunc);
+    if (!has_header)
+      window_stats << WindowStats::header() << std::endl;
+  }
+
+  // The stats line of a window is written with its outputs
+  WindowWriter writer(outputs, pending, WindowWriter::MAX_PENDING_BYTES,
+                      window_stats.is_open() ? &window_stats : NULL);
+
+  // Windows reserve their assembly footprint in this budget, if any
+  std::unique_ptr<MemoryBudget> memory_budget;
+  if (opt::max_mem > 0)
+    memory_budget.reset(new MemoryBudget(opt::max_mem));
+
+  // Assembles a window whose reads have been collected, then aligns and
+  // writes its contigs.
+  // The outputs of a window are buffered, then handed to the writer, which
+  // commits them together with their journal entry.
+  auto process_window = [&writer, &detect_library, &ref_genome, &align_contexts, &reference_index,
+                         &bam_readers, &params, &memory_budget](int id, size_t w,
+                                                  const SeqLib::GenomicRegion &region,
+                                                  LocalAssemblyWindow &local_win,
+                                                  bool reserved) {
+      WindowStats &stats = local_win.getStats();
+      if (params.kmer_filter) {
+        std::string &reference = align_contexts[id]->referenceBuffer();
+        reference.clear();
+        if (params.kmer_filter_reference)
+          ref_genome.fetch(region.ChrName(bam_readers[0]->Header()), region.pos1, region.pos2,
+                           reference);
+        local_win.filterReadsByKmers(reference);
+      }
+
+      // A window that could never fit the budget is downsampled to it. The
+      // reservation is held until the window is written. reserved: the
+      // window is covered by the reservation of its group.
+      size_t footprint = local_win.estimateAssemblyBytes();
+      if (memory_budget && footprint > memory_budget->limit()) {
+        local_win.downsampleGenomewideReads((double)memory_budget->limit() / footprint);
+        footprint = local_win.estimateAssemblyBytes();
+      }
+      std::unique_ptr<StageTimer> wait_timer(new StageTimer(stats, STAGE_MEMORY_WAIT));
+      MemoryReservation reservation(reserved ? NULL : memory_budget.get(), footprint);
+      wait_timer.reset();
+      stats.reserved_bytes = reserved && memory_budget ? footprint : reservation.bytes();
 
       local_win.assembleReads();
 
       std::cerr << "Contigs: " << local_win.getContigs().size() << std::endl;
       if (local_win.getContigs().size() == 0) {
         std::cerr << "No contigs for " << local_win.getPrefix() << std::endl;
+        stats.finish();
+        writer.submit(WindowRecord{w, local_win.getPrefix(), "", "", ""}, &stats, id);
         return;
       }
+      std::ostringstream contigs, hits, alns;
 
-      ContigAlignment read_aln(local_win.getContigs(), local_win.getPrefix());
-      read_aln.alignReads(local_win.getReads());
+      // timers are reset as soon as their stage is over
+      std::unique_ptr<StageTimer> timer(new StageTimer(stats, STAGE_CONTIG_MAPPING));
+      // The contigs are indexed for the mate graph and the library hits
+      std::unique_ptr<ContigAlignment> contig_aln;
+      if (opt::mate_graph || !detect_library.empty())
+        contig_aln.reset(new ContigAlignment(local_win.getContigs(), local_win.getPrefix()));
+      // the reads are only mapped back to the contigs for the mate graph
+      if (opt::mate_graph) {
+        ContigMatePairGraph mate_graph = contig_aln->alignReads(local_win.getReads(), *align_contexts[id],
+                                                               opt::map_threads);
+        std::ofstream gfa_out(local_win.getPrefix() + "_mates.gfa");
+        mate_graph.writeGFA(gfa_out);
+      }
+      timer.reset();
 
-      hits_mutex.lock();
-      read_aln.detectSequences(detect_seqs, hits);
-      hits_mutex.unlock();
+      // the library sequences that can hit the contigs are the queries,
+      // written to the window's buffer
+      timer.reset(new StageTimer(stats, STAGE_DETECT_SEQUENCES));
+      if (!detect_library.empty())
+        contig_aln->detectSequences(detect_library, hits, *align_contexts[id]);
+      contig_aln.reset();
+      timer.reset();
 
       std::cerr << "Reads: " << local_win.getReads().size() << std::endl;
       local_win.clearReads();
 
-      // MUTEX: only one thread must write to the fasta file at a time
-      fasta_mutex.lock();
-      local_win.writeContigs(fasta);
-      fasta_mutex.unlock();
+      local_win.writeContigs(contigs);
+
+      timer.reset(new StageTimer(stats, STAGE_REFERENCE_ALIGNMENT));
+      std::string chrom = region.ChrName(bam_readers[0]->Header());
+      std::unique_ptr<LocalAlignment> local_alignment(
+          reference_index ? new LocalAlignment(chrom, region.pos1, region.pos2,
+                                               *reference_index, opt::ref_flank)
+                          : new LocalAlignment(chrom, region.pos1, region.pos2, ref_genome,
+                                               *align_contexts[id], opt::aligner));
+      local_alignment->align(local_win.getContigs(), *align_contexts[id]);
+      timer.reset();
+
+      local_alignment->writeAlignments(alns);
+
+      stats.finish();
+      writer.submit(WindowRecord{w, local_win.getPrefix(), contigs.str(), hits.str(), alns.str()},
+                    &stats, id);
+  };
 
-      LocalAlignment local_alignment(region.ChrName(bam_readers[0]->Header()),
-                                      region.pos1, region.pos2, *ref_genomes[id]);
-      local_alignment.align(local_win.getContigs());
+  bool scan_failed = false;
+  if (!opt::inverted) {
+    // Workers take the next window from the shared queue of the pool as soon
+    // as they are idle, costliest first, so that the cheap ones fill the
+    // gaps. The writer holds back the windows that finish ahead of their turn.
+    for (size_t g : group_order) {
+      const SeqLib::GenomicRegion &span = groups[g].span;
+      std::string chrom = span.ChrName(bam_readers[0]->Header());
+      std::cerr << "Running " << chrom << " " << span.pos1 << " " << span.pos2 << std::endl;
+      auto future = thread_pool.push([g, &groups, &regions, &params, &process_window,
+                                      &writer, &bam_readers, &bx_bam_walkers,
+                                      &memory_budget](int id) {
 
-      // MUTEX: only one thread must write to alignments
-      alns_mutex.lock();
-      local_alignment.writeAlignments(alns);
-      alns_mutex.unlock();
-    });
+        std::cerr << "ID " << id << std::endl;
+        size_t i = 0;
+        try {
+          WindowGroup group(groups[g], regions, *bam_readers[id], *bx_bam_walkers[id], params);
+          group.retrieveGenomewideReads(memory_budget.get());
+          for (; i < group.size(); i++) {
+            process_window(id, groups[g].windows[i], group.region(i), group.window(i), true);
+            group.release(i);
+          }
+        } catch (const std::exception &e) {
+          // the writer passes over the windows left, to be run again on resume
+          std::cerr << "Failed window "
+                    << regions[groups[g].windows[i]].ToString(bam_readers[id]->Header())
+                    << ": " << e.what() << std::endl;
+          for (; i < groups[g].windows.size(); i++)
+            writer.skip(groups[g].windows[i]);
+        }
+      });
+    }
+  } else {
+    // Windows are collected, scanned and assembled in batches. With
+    // --max-mem, the estimated footprints of the windows of a batch fit the
+    // budget together, and a batch starts once the previous one is done, so
+    // that the reads of all windows are never held at once. Without it, all
+    // windows are one batch.
+    std::vector<std::unique_ptr<LocalAssemblyWindow>> windows(pending.size());
+    size_t collected = 0, next = 0;
+    while (next < pending.size()) {
+      BarcodeRouter router(bx_dictionary);
+      std::vector<size_t> batch;
+      size_t batch_bytes = 0;
+      while (next < pending.size()) {
+        // First pass: local reads and barcodes, a few windows ahead
+        if (next == collected) {
+          size_t end = memory_budget ? std::min(pending.size(), collected + opt::num_threads)
+                                     : pending.size();
+          std::vector<std::future<void>> local;
+          for (size_t p = collected; p < end; p++) {
+            local.push_back(thread_pool.push([p, &pending, &regions, &windows, &params,
+                                              &writer, &bam_readers, &bx_bam_walkers](int id) {
+              // a failed window is left out of the batch
+              try {
+                windows[p].reset(new LocalAssemblyWindow(regions[pending[p]], *bam_readers[id],
+                                                         *bx_bam_walkers[id], params));
+                windows[p]->collectLocalBarcodes();
+                StageTimer timer(windows[p]->getStats(), STAGE_BARCODE_COLLECTION);
+                std::cerr << "Pre barcode collection: " << windows[p]->getReads().size()
+                          << std::endl;
+                windows[p]->reportBarcodes();
+              } catch (const std::exception &e) {
+                std::cerr << "Failed window " << regions[pending[p]].ToString(bam_readers[id]->Header())
+                          << ": " << e.what() << std::endl;
+                windows[p].reset();
+                writer.skip(pending[p]);
+              }
+            }));
+          }
+          for (auto &f : local)
+            f.get();
+          collected = end;
+        }
+
+        if (!windows[next]) {
+          next++;
+          continue;
+        }
+        // An upper bound, since the read filter drops most barcode records.
+        std::unique_ptr<StageTimer> timer(
+            new StageTimer(windows[next]->getStats(), STAGE_BARCODE_COLLECTION));
+        std::vector<BxBarcodeId> barcodes = windows[next]->getBarcodes();
+        size_t bytes = windows[next]->estimateAssemblyBytes(router.records(barcodes));
+        // the window starts the next batch
+        if (memory_budget && !batch.empty() && batch_bytes + bytes > memory_budget->limit())
+          break;
+        router.addWindow(barcodes);
+        timer.reset();
+        batch.push_back(next++);
+        batch_bytes += bytes;
+      }
+
+      // Second pass: one scan of the barcode BAM for the batch. Windows are
+      // assembled by the thread pool as soon as their reads are complete.
+      // A failed window is left out of the journal, like in the default mode.
+      // If the scan fails, the windows it completed are still written, the
+      // others can be run again with --resume.
+      std::vector<std::future<void>> processed(batch.size());
+      try {
+        router.scan(bx_bam_walkers, [&thread_pool, &batch, &processed, &pending, &regions,
+                                     &windows, &process_window, &writer,
+                                     &bam_readers](size_t i, BamReadVector &reads) {
+          std::shared_ptr<BamReadVector> genomewide_reads = std::make_shared<BamReadVector>();
+          genomewide_reads->swap(reads);
+          size_t p = batch[i];
+          processed[i] = thread_pool.push([p, genomewide_reads, &pending, &regions, &windows,
+                                           &process_window, &writer, &bam_readers](int id) {
+            std::cerr << "ID " << id << std::endl;
+            try {
+              windows[p]->addGenomewideReads(*genomewide_reads);
+              genomewide_reads->clear();
+              process_window(id, pending[p], regions[pending[p]], *windows[p], false);
+            } catch (const std::exception &e) {
+              std::cerr << "Failed window " << regions[pending[p]].ToString(bam_readers[id]->Header())
+                        << ": " << e.what() << std::endl;
+              writer.skip(pending[p]);
+            }
+            windows[p].reset();
+          });
+        });
+      } catch (const std::exception &e) {
+        std::cerr << "Failed to read the barcode BAM: " << e.what() << std::endl;
+        scan_failed = true;
+      }
+      // windows that were never completed have no future
+      for (auto &f : processed)
+        if (f.valid())
+          f.wait();
+      if (scan_failed)
+        break;
+    }
   }
 
   thread_pool.stop(true);
-  fasta.close();
-  alns.close();
+  // the windows journaled before a failed write can be resumed from
+  bool write_failed = false;
+  try {
+    writer.finish();
+    outputs.close();
+  } catch (const std::exception &e) {
+    std::cerr << "Failed to write the outputs: " << e.what() << std::endl;
+    write_failed = true;
+  }
+  if (window_stats.is_open())
+    window_stats.close();
+
+  if (bx_cache)
+    bx_cache -> writeStats(std::cerr);
+
+  uint64_t records_read = 0, records_rejected = 0, bytes_rejected = 0;
+  for (auto w : bx_bam_walkers) {
+    records_read += w->fetchStats().records_read;
+    records_rejected += w->fetchStats().records_rejected;
+    bytes_rejected += w->fetchStats().bytes_rejected;
+  }
+  std::cerr << "Barcode records read: " << records_read
+            << " rejected: " << records_rejected
+            << " bytes not copied: " << bytes_rejected << std::endl;
+
+  // readers must be closed before their decompression pool goes away
+  for (size_t i = 0; i < opt::num_threads; i++) {
+    delete bam_readers[i];
+    delete bx_bam_walkers[i];
+  }
+  if (hts_pool.pool)
+    hts_tpool_destroy(hts_pool.pool);
+  return scan_failed || write_failed ? 1 : 0;
 }
@@ -0,0 +1,122 @@
+#include "BarcodeRouter.h"
+#include <atomic>
+#include <climits>
+#include <exception>
+#include <thread>
+
+BarcodeRouter::BarcodeRouter(std::shared_ptr<const BxBarcodeDictionary> dictionary)
+    : m_dictionary(dictionary) {}
+
+size_t BarcodeRouter::addWindow(const std::vector<BxBarcodeId> &barcodes) {
+  size_t window = m_window_tids.size();
+  std::vector<int> tids;
+  for (const auto &barcode : barcodes) {
+    int tid = m_dictionary->barcodeToTid(barcode);
+    if (tid >= 0)
+      tids.push_back(tid);
+  }
+  std::sort(tids.begin(), tids.end());
+  tids.erase(std::unique(tids.begin(), tids.end()), tids.end());
+
+  for (size_t slot = 0; slot < tids.size(); slot++)
+    m_tid_windows[tids[slot]].push_back(WindowSlot{window, slot});
+  m_window_tids.push_back(tids.size());
+  return window;
+}
+
+uint64_t BarcodeRouter::records(const std::vector<BxBarcodeId> &barcodes) const {
+  uint64_t records = 0;
+  for (const auto &barcode : barcodes) {
+    int tid = m_dictionary->barcodeToTid(barcode);
+    if (tid >= 0)
+      records += m_dictionary->records(tid);
+  }
+  return records;
+}
+
+void BarcodeRouter::scan(const std::vector<BxBamWalker *> &walkers,
+                         const std::function<void(size_t, BamReadVector &)> &on_complete) {
+  size_t num_windows = m_window_tids.size();
+  std::unique_ptr<std::atomic<size_t>[]> remaining(new std::atomic<size_t>[num_windows]);
+  // The reads of each barcode of a window are kept apart, and only joined in
+  // barcode order once the window is complete. Each barcode is read by a
+  // single thread, so the slots need no lock.
+  std::vector<std::vector<BamReadVector>> window_reads(num_windows);
+
+  for (size_t w = 0; w < num_windows; w++) {
+    remaining[w] = m_window_tids[w];
+    window_reads[w].resize(m_window_tids[w]);
+    // nothing to wait for
+    if (m_window_tids[w] == 0) {
+      BamReadVector reads;
+      on_complete(w, reads);
+    }
+  }
+
+  // The barcode BAM is sorted by target ID, so contiguous ranges of target
+  // IDs are contiguous ranges of the file.
+  std::vector<int> tids;
+  tids.reserve(m_tid_windows.size());
+  for (const auto &t : m_tid_windows)
+    tids.push_back(t.first);
+  std::sort(tids.begin(), tids.end());
+
+  // A barcode is done once its block has been read. Windows are released
+  // when their last barcode is done.
+  auto finish_tid = [&](int tid) {
+    for (const WindowSlot &ws : m_tid_windows.at(tid)) {
+      if (--remaining[ws.window] == 0) {
+        std::vector<BamReadVector> &slots = window_reads[ws.window];
+        size_t size = 0;
+        for (const BamReadVector &slot : slots)
+          size += slot.size();
+        BamReadVector reads;
+        reads.reserve(size);
+        for (BamReadVector &slot : slots) {
+          reads.insert(reads.end(), slot.begin(), slot.end());
+          BamReadVector().swap(slot);
+        }
+        on_complete(ws.window, reads);
+      }
+    }
+  };
+
+  size_t num_parts = std::max<size_t>(1, std::min(walkers.size(), tids.size()));
+  // An exception escaping a thread would terminate the process, so the
+  // errors of the parts are rethrown once all threads are joined.
+  std::vector<std::exception_ptr> errors(num_parts);
+  std::vector<std::thread> threads;
+  for (size_t part = 0; part < num_parts; part++) {
+    std::vector<int> part_tids(tids.begin() + part * tids.size() / num_parts,
+                               tids.begin() + (part + 1) * tids.size() / num_parts);
+    BxBamWalker *walker = walkers[part];
+
+    threads.emplace_back([&, part, part_tids, walker]() {
+      // Reads arrive in target ID order. Seeing a target ID means that all
+      // the smaller ones of this range are complete.
+      size_t next = 0;
+      auto finish_until = [&](int tid) {
+        while (next < part_tids.size() && part_tids[next] < tid)
+          finish_tid(part_tids[next++]);
+      };
+
+      try {
+        walker->streamReadsByTids(part_tids, [&](int tid, SeqLib::BamRecord &r) {
+          finish_until(tid);
+          for (const WindowSlot &ws : m_tid_windows.at(tid))
+            window_reads[ws.window][ws.slot].push_back(r);
+        });
+        finish_until(INT_MAX);
+      } catch (...) {
+        // the windows of the remaining barcodes are never completed
+        errors[part] = std::current_exception();
+      }
+    });
+  }
+
+  for (auto &t : threads)
+    t.join();
+  for (auto &e : errors)
+    if (e)
+      std::rethrow_exception(e);
+}
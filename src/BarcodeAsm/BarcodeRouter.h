@@ -0,0 +1,52 @@
+#ifndef BARCODE_ROUTER_H
+#define BARCODE_ROUTER_H
+
+#include "BxBamWalker.h"
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+class BarcodeRouter {
+    /* Inverted barcode collection for large region files. Instead of fetching
+       the barcodes of each window separately, the barcodes of all windows are
+       registered first. The barcode sorted BAM is then streamed once, split in
+       contiguous barcode ranges between threads, and every read is routed to
+       all the windows that need its barcode.
+    */
+
+public:
+    BarcodeRouter(std::shared_ptr<const BxBarcodeDictionary> dictionary);
+
+    // Registers the barcodes of a window. Returns the index of the window.
+    size_t addWindow(const std::vector<BxBarcodeId> &barcodes);
+
+    // Records of these barcodes in the barcode BAM, before the read filter.
+    uint64_t records(const std::vector<BxBarcodeId> &barcodes) const;
+
+    /* Streams the barcode blocks, with one thread per walker. on_complete is
+       called with the window index and its genome wide reads as soon as all of
+       the window's barcodes have been read. It may be called from any of the
+       scanning threads. The reads of a window are in barcode order, whatever
+       the number of threads. If a thread fails to read the BAM, the other
+       threads finish their range and the first error is rethrown; the windows
+       that needed the failed barcodes are not completed. */
+    void scan(const std::vector<BxBamWalker *> &walkers,
+              const std::function<void(size_t, BamReadVector &)> &on_complete);
+
+private:
+    // A barcode of a window, and its position among the window's barcodes
+    struct WindowSlot {
+        size_t window;
+        size_t slot;
+    };
+
+    std::shared_ptr<const BxBarcodeDictionary> m_dictionary;
+    // windows that need each barcode target ID
+    std::unordered_map<int, std::vector<WindowSlot>> m_tid_windows;
+    // number of distinct barcodes per window
+    std::vector<size_t> m_window_tids;
+};
+
+#endif
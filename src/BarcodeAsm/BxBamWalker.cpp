@@ -1,83 +1,286 @@
 #include "BxBamWalker.h"
 
 BxBamWalker::BxBamWalker(const std::string &bx_bam_path,
+                         std::shared_ptr<const BxBarcodeDictionary> dictionary,
                          const std::string _prefix,
                          bool _weird_reads_only,
                          int _poor_alignment_max_mapq )
     : prefix(_prefix), weird_reads_only(_weird_reads_only),
-      POOR_ALIGNMENT_MAX_MAPQ(_poor_alignment_max_mapq)
+      POOR_ALIGNMENT_MAX_MAPQ(_poor_alignment_max_mapq), m_dictionary(dictionary)
 {
-  BamReader();
-  Open(bx_bam_path);
+  openBam(bx_bam_path);
+}
+
+BxBamWalker::BxBamWalker(const std::string &bam_path,
+                         std::shared_ptr<const BxSidecarIndex> sidecar,
+                         const std::string _prefix,
+                         bool _weird_reads_only,
+                         int _poor_alignment_max_mapq )
+    : prefix(_prefix), weird_reads_only(_weird_reads_only),
+      POOR_ALIGNMENT_MAX_MAPQ(_poor_alignment_max_mapq), m_sidecar(sidecar)
+{
+  openBam(bam_path);
+}
+
+BxBamWalker::BxBamWalker()
+    : weird_reads_only(true), m_stats(std::make_shared<BxFetchStats>()) {}
+
+void BxBamWalker::openBam(const std::string &bam_path) {
+  m_stats = std::make_shared<BxFetchStats>();
+  // The walker only seeks to index chunks, so it never parses the header.
+  m_hts_file = std::shared_ptr<htsFile>(hts_open(bam_path.c_str(), "r"),
+                                        [](htsFile *f) { if (f) hts_close(f); });
+  if (!m_hts_file)
+    throw std::runtime_error("Could not open " + bam_path);
   std::cerr << "Poor alignment max MAPQ: " << POOR_ALIGNMENT_MAX_MAPQ << std::endl;
 }
 
-BxBamWalker::BxBamWalker() : weird_reads_only(true) { BamReader(); }
+std::vector<BxBarcodeId>
+BxBamWalker::orderBarcodes(const std::vector<BxBarcodeId> &bx_barcodes) const {
+  std::vector<BxBarcodeId> ordered;
+  ordered.reserve(bx_barcodes.size());
 
-BamReadVector
-    BxBamWalker::fetchReadsByBxBarcode(const BxBarcode &bx_barcode) {
-    BamReadVector read_vector;
-    // We must convert the stirng barcode into an index ID. We retrieve this ID
-    // from the BAM header.
-    SeqLib::BamHeader header = Header();
-    SeqLib::GenomicRegion bx_region(bx_barcode, "1", "2", header);
+  if (m_sidecar) {
+    // order by the first record of each barcode
+    std::vector<std::pair<uint64_t, BxBarcodeId>> offsets;
+    for (auto id : bx_barcodes)
+      if (m_sidecar->contains(id))
+        offsets.push_back(std::make_pair(m_sidecar->firstOffset(id), id));
+    std::sort(offsets.begin(), offsets.end());
+    for (const auto &o : offsets)
+      if (ordered.empty() || ordered.back() != o.second)
+        ordered.push_back(o.second);
+    return ordered;
+  }
 
+  // Resolve all barcodes against the header, in tid order, which is also
+  // their order in the barcode sorted BAM.
+  std::vector<int> tids;
+  tids.reserve(bx_barcodes.size());
+  for (auto id : bx_barcodes) {
+    int tid = m_dictionary->barcodeToTid(id);
     // Check if this barcode exists in this BxBamWalker
-    if (header.Name2ID(bx_barcode) < 0) {
-        return read_vector;
+    if (tid >= 0)
+      tids.push_back(tid);
+  }
+  std::sort(tids.begin(), tids.end());
+  tids.erase(std::unique(tids.begin(), tids.end()), tids.end());
+  for (int tid : tids)
+    ordered.push_back(m_dictionary->tidToBarcodeId(tid));
+  return ordered;
+}
+
+void BxBamWalker::fetchReadsByBxBarcode(const std::vector<BxBarcodeId> &bx_barcodes,
+                                        const BxReadSink &sink) {
+  std::vector<BxBarcodeId> ids = orderBarcodes(bx_barcodes);
+
+  if (!m_cache) {
+    streamBarcodes(ids, [this, &sink](BxBarcodeId id, bam1_t *b) {
+      if (acceptRecord(b))
+        sink(id, b);
+    });
+    return;
+  }
+
+  // Serve what we can from the shared cache and fetch the rest from disk
+  std::vector<SharedPackedBxRecords> blocks(ids.size());
+  std::vector<BxBarcodeId> missing;
+  for (size_t i = 0; i < ids.size(); i++) {
+    blocks[i] = m_cache->get(ids[i]);
+    if (!blocks[i])
+      missing.push_back(ids[i]);
+  }
+
+  if (!missing.empty()) {
+    std::unordered_map<BxBarcodeId, std::shared_ptr<PackedBxRecords>> fetched;
+    for (auto id : missing)
+      fetched[id] = std::make_shared<PackedBxRecords>();
+    streamBarcodes(missing, [this, &fetched](BxBarcodeId id, bam1_t *b) {
+      if (acceptRecord(b))
+        BxReadCache::pack(b, *fetched[id]);
+    });
+    for (size_t i = 0; i < ids.size(); i++) {
+      if (!blocks[i]) {
+        blocks[i] = fetched[ids[i]];
+        m_cache->put(ids[i], blocks[i]);
+      }
+    }
+  }
+
+  // keep the reads in barcode order, as if they were all read from disk
+  for (size_t i = 0; i < ids.size(); i++) {
+    BxBarcodeId id = ids[i];
+    BxReadCache::unpack(*blocks[i], [id, &sink](bam1_t *b) { sink(id, b); });
+  }
+}
+
+BxBarcodeId BxBamWalker::barcodeIdOf(const SeqLib::BamRecord &r) const {
+  // After bxtools convert, the barcode of a read is its reference.
+  if (!m_sidecar)
+    return m_dictionary->tidToBarcodeId(r.ChrID());
+  std::string bx_tag;
+  if (r.GetZTag("BX", bx_tag) && !bx_tag.empty())
+    return packBarcode(bx_tag);
+  return 0;
+}
+
+void BxBamWalker::streamBarcodes(const std::vector<BxBarcodeId> &bx_barcodes,
+                                 const std::function<void(BxBarcodeId, bam1_t *)> &callback) {
+  // Collect the index chunks of every barcode block
+  BgzfChunks chunks;
+  std::vector<int> tids;
+  std::vector<BxBarcodeId> sorted_ids;
+  if (m_sidecar) {
+    for (auto id : bx_barcodes)
+      m_sidecar->appendChunks(id, chunks);
+    sorted_ids = bx_barcodes;
+    std::sort(sorted_ids.begin(), sorted_ids.end());
+  } else {
+    for (auto id : bx_barcodes) {
+      int tid = m_dictionary->barcodeToTid(id);
+      hts_itr_t *itr = tid < 0 ? NULL : sam_itr_queryi(m_dictionary->index(), tid,
+                                                       BX_BLOCK_BEG, BX_BLOCK_END);
+      if (itr == NULL)
+        continue;
+      tids.push_back(tid);
+      for (int i = 0; i < itr->n_off; i++) {
+        hts_pair64_t chunk;
+        chunk.u = itr->off[i].u;
+        chunk.v = itr->off[i].v;
+        chunks.push_back(chunk);
+      }
+      hts_itr_destroy(itr);
     }
+    std::sort(tids.begin(), tids.end());
+  }
 
-    SetRegion(bx_region);
-
-    // BX tags are sorted and indexed in large contiguous blocks within the BAM.
-    // Each BX tag is a region. Therefore, we stop when we exhaust the region.
-    while (true) {
-        // Careful. We cannot reuse BamRecords since we must avoid pushing shallow
-        // copies into the BamReadVector.
-        SeqLib::BamRecord bx_record;
-
-        // Are we still within the same BX block?
-        if (GetNextRecord(bx_record)) {
-            // do we only want weird reads?
-            if (weird_reads_only) {
-                if(isBxReadWeird(bx_record))
-                    read_vector.push_back(bx_record);
-            } else
-                read_vector.push_back(bx_record);
-        } else
-            break;
+  BGZF *fp = m_hts_file->fp.bgzf;
+  bam1_t *b = bam_init1();
+  int ret = 0;
+  for (const auto &chunk : coalesceChunks(chunks)) {
+    if (bgzf_seek(fp, chunk.u, SEEK_SET) < 0) {
+      bam_destroy1(b);
+      throw std::runtime_error("Failed to seek in barcode BAM");
     }
-    return read_vector;
+    while ((uint64_t)bgzf_tell(fp) < chunk.v && (ret = bam_read1(fp, b)) >= 0) {
+      // Coalesced chunks also span records of barcodes we did not ask for.
+      BxBarcodeId id = 0;
+      if (m_sidecar) {
+        uint8_t *bx = bam_aux_get(b, "BX");
+        const char *bx_tag = bx == NULL ? NULL : bam_aux2Z(bx);
+        if (bx_tag == NULL)
+          continue;
+        id = packBarcode(bx_tag, strlen(bx_tag));
+        if (!std::binary_search(sorted_ids.begin(), sorted_ids.end(), id))
+          continue;
+      } else {
+        // Apply the same overlap test as the htslib region iterator.
+        if (!std::binary_search(tids.begin(), tids.end(), b->core.tid))
+          continue;
+        if (b->core.pos >= BX_BLOCK_END || bam_endpos(b) <= BX_BLOCK_BEG)
+          continue;
+        id = m_dictionary->tidToBarcodeId(b->core.tid);
+      }
+      callback(id, b);
+    }
+    if (ret < -1)
+      break;
+  }
+  bam_destroy1(b);
+  // -1 is the end of the file, anything below is a truncated or corrupt record
+  if (ret < -1)
+    throw std::runtime_error("Failed to read barcode BAM");
+}
+
+void BxBamWalker::streamReadsByTids(const std::vector<int> &tids,
+                                    const std::function<void(int, SeqLib::BamRecord &)> &callback) {
+  std::vector<BxBarcodeId> ids;
+  ids.reserve(tids.size());
+  for (int tid : tids)
+    ids.push_back(m_dictionary->tidToBarcodeId(tid));
+  streamBarcodes(ids, [this, &callback](BxBarcodeId, bam1_t *b) {
+    if (!acceptRecord(b))
+      return;
+    SeqLib::BamRecord bx_record;
+    bx_record.assign(bam_dup1(b));
+    callback(b->core.tid, bx_record);
+  });
+}
+
+bool BxBamWalker::acceptRecord(const bam1_t *b) {
+  // The filter only needs the core fields, so it runs on the reused read
+  // buffer, before any copy of the record is made.
+  m_stats->records_read++;
+  // do we only want weird reads?
+  if (!weird_reads_only || isBxRecordWeird(b))
+    return true;
+  m_stats->records_rejected++;
+  // what bam_dup1 would have allocated for this record
+  m_stats->bytes_rejected += sizeof(bam1_t) + b->l_data;
+  return false;
+}
+
+void BxBamWalker::setThreadPool(htsThreadPool *pool) {
+  if (m_hts_file && pool != NULL && pool->pool != NULL)
+    hts_set_opt(m_hts_file.get(), HTS_OPT_THREAD_POOL, pool);
 }
 
-BamReadVector
-BxBamWalker::fetchReadsByBxBarcode(const std::vector<BxBarcode> &bx_barcodes) {
-  BamReadVector all_reads;
-  for (const auto &barcode : bx_barcodes) {
-    std::string barcode_copy = barcode;
-    // "-" gets translated to "_" during bxtools convert. We must correct this.
-    std::replace(barcode_copy.begin(), barcode_copy.end(), '-', '_');
-    BamReadVector reads = fetchReadsByBxBarcode(barcode_copy);
-    // move the reads into all_reads
-    std::move(reads.begin(), reads.end(), std::back_inserter(all_reads));
+bool BxBamWalker::countRecords(const std::vector<BxBarcodeId> &bx_barcodes,
+                               uint64_t &records) const {
+  if (!m_dictionary)
+    return false;
+  records = 0;
+  for (BxBarcodeId id : bx_barcodes) {
+    int tid = m_dictionary->barcodeToTid(id);
+    if (tid >= 0)
+      records += m_dictionary->records(tid);
   }
-  return all_reads;
+  return true;
+}
+
+const BxFetchStats &BxBamWalker::fetchStats() const { return *m_stats; }
+
+void BxBamWalker::setReadCache(std::shared_ptr<BxReadCache> cache) {
+  m_cache = cache;
 }
 
+BgzfChunks BxBamWalker::coalesceChunks(BgzfChunks chunks) const {
+  BgzfChunks merged;
+  std::sort(chunks.begin(), chunks.end(),
+            [](const hts_pair64_t &a, const hts_pair64_t &b) { return a.u < b.u; });
+
+  for (const auto &chunk : chunks) {
+    // Compare the compressed block addresses of the two chunks. If the next
+    // chunk starts close to where the last one ends, stream through the gap.
+    if (!merged.empty() &&
+        (int64_t)(chunk.u >> 16) - (int64_t)(merged.back().v >> 16) <= MAX_CHUNK_GAP) {
+      merged.back().v = std::max(merged.back().v, chunk.v);
+    } else
+      merged.push_back(chunk);
+  }
+  return merged;
+}
 
 bool BxBamWalker::isBxReadWeird(SeqLib::BamRecord &r) {
+    return isBxRecordWeird(r.raw());
+}
+
+bool BxBamWalker::isBxRecordWeird(const bam1_t *b) const {
     // look for unmapped reads, unpaired reads and poor alignments
     // NOTE: the ProperPair flag is part of the SAM specification and is set by
     // the aligner Includes information on insert size, mate read orientation
     // etc...
-    bool isWeird = !r.PairMappedFlag() || !r.MappedFlag() ||
-        (r.MapQuality() <= POOR_ALIGNMENT_MAX_MAPQ);// || !r.ProperPair();
+    bool isWeird = (b->core.flag & BAM_FMUNMAP) || !(b->core.flag & BAM_FPAIRED) ||
+        (b->core.flag & BAM_FUNMAP) ||
+        (b->core.qual <= POOR_ALIGNMENT_MAX_MAPQ);// || !(b->core.flag & BAM_FPROPER_PAIR);
 
     // report which flag was set
 #ifdef DEBUG_BX_BAM_WALKER
     if (isWeird)
-        std::cerr << !r.PairMappedFlag() << !r.MappedFlag() << !r.ProperPair()
-                  << (r.MapQuality() < POOR_ALIGNMENT_MAX_MAPQ) << std::endl;
+        std::cerr << ((b->core.flag & BAM_FMUNMAP) != 0 || (b->core.flag & BAM_FPAIRED) == 0)
+                  << ((b->core.flag & BAM_FUNMAP) != 0)
+                  << ((b->core.flag & BAM_FPROPER_PAIR) == 0)
+                  << (b->core.qual < POOR_ALIGNMENT_MAX_MAPQ) << std::endl;
 #endif
     return isWeird;
 }
@@ -1,13 +1,21 @@
 #ifndef BX_BAM_WALKER_H
 #define BX_BAM_WALKER_H
 
+#include "BxBarcodeDictionary.h"
+#include "BxReadCache.h"
+#include "BxSidecarIndex.h"
 #include "SeqLib/BFC.h"
-#include "SeqLib/BamReader.h"
 #include "SeqLib/BamRecord.h"
 #include "SeqLib/GenomicRegion.h"
+#include "htslib/sam.h"
+#include "htslib/thread_pool.h"
 #include <algorithm>
+#include <atomic>
+#include <cstdint>
 #include <exception>
+#include <functional>
 #include <iostream>
+#include <memory>
 #include <set>
 #include <stdexcept>
 #include <string>
@@ -15,34 +23,101 @@
 #include <unordered_map>
 #include <vector>
 
-/* Let's distinguish regular strings from BxBarcodes in the source code */
-typedef std::string BxBarcode;
 typedef std::vector<SeqLib::BamRecord> BamReadVector;
+// Receives the reads of a fetch. The record is only valid during the call.
+typedef std::function<void(BxBarcodeId, const bam1_t *)> BxReadSink;
 
-class BxBamWalker : public SeqLib::BamReader {
+/* Counters of the read filter, shared between copies of a walker */
+struct BxFetchStats {
+    std::atomic<uint64_t> records_read{0};
+    std::atomic<uint64_t> records_rejected{0};
+    // heap memory not spent on copies of rejected records
+    std::atomic<uint64_t> bytes_rejected{0};
+};
+
+class BxBamWalker {
     /* Reads a BAM file that was produced by the lariat aligner. This file must be
        prepared by flipping the chromosome and BX tag with bxtools convert. Then
        this file must be sorted and indexed by the BX tag using samtools. This
        allows fast retrieval of reads having a specific bx tag.
+
+       The header and index are not loaded by the walker. They are looked up in
+       a BxBarcodeDictionary shared by all walkers of the process.
+
+       Alternatively, the walker reads the original position sorted BAM, using
+       the barcode index written by BarcodeAsm index (see BxSidecarIndex).
     */
 
     public:
     /* bx_bam_path: BAM file indexed by bx tag. */
     BxBamWalker();
     BxBamWalker(const std::string &bx_bam_path,
+                std::shared_ptr<const BxBarcodeDictionary> dictionary,
+                const std::string _prefix = "0000",
+                bool _weird_reads_only = true, int _poor_alignment_max_mapq = 10);
+    /* bam_path: position sorted BAM with a barcode sidecar index. */
+    BxBamWalker(const std::string &bam_path,
+                std::shared_ptr<const BxSidecarIndex> sidecar,
                 const std::string _prefix = "0000",
                 bool _weird_reads_only = true, int _poor_alignment_max_mapq = 10);
 
-    /*  */
-    BamReadVector fetchReadsByBxBarcode(const BxBarcode &bx_barcode);
-    BamReadVector fetchReadsByBxBarcode(const std::vector<BxBarcode> &bx_barcodes);
+    /* Batch fetch. The barcode blocks are visited in header order and their
+       index chunks are coalesced, so each BGZF block is read at most once.
+       Reads are handed to the sink without copying them into BamRecords. */
+    void fetchReadsByBxBarcode(const std::vector<BxBarcodeId> &bx_barcodes,
+                               const BxReadSink &sink);
+    /* Records of the barcodes in the index, before the read filter. False if
+       the index has no counts, as with the sidecar index. */
+    bool countRecords(const std::vector<BxBarcodeId> &bx_barcodes, uint64_t &records) const;
+    // Barcode of a read returned by the fetch.
+    BxBarcodeId barcodeIdOf(const SeqLib::BamRecord &r) const;
+    /* Streams the reads of the barcode blocks (sorted target IDs) in file order,
+       with the same read filter as the fetch. Used by callers that route the
+       reads themselves instead of collecting them. Needs a barcode sorted BAM. */
+    void streamReadsByTids(const std::vector<int> &tids,
+                           const std::function<void(int, SeqLib::BamRecord &)> &callback);
     std::string prefix;
 
     bool isBxReadWeird(SeqLib::BamRecord &r);
+    bool isBxRecordWeird(const bam1_t *b) const;
+    const BxFetchStats &fetchStats() const;
+
+    /* Barcode blocks are looked up in this cache before going to disk. The
+       cache may be shared by all walkers of the process. */
+    void setReadCache(std::shared_ptr<BxReadCache> cache);
+    /* BGZF blocks are inflated by this pool, which may be shared by all
+       readers of the process. The pool must outlive the walker. */
+    void setThreadPool(htsThreadPool *pool);
+
+    // Chunks whose compressed offsets are closer than this are read in one
+    // sequential pass instead of seeking between them.
+    int64_t MAX_CHUNK_GAP = 64 * 1024;
 
     private:
+    void openBam(const std::string &bam_path);
+    // Barcodes present in the BAM, without duplicates, in file order.
+    std::vector<BxBarcodeId> orderBarcodes(const std::vector<BxBarcodeId> &bx_barcodes) const;
+    // Calls back with every record of the barcodes, in file order.
+    void streamBarcodes(const std::vector<BxBarcodeId> &bx_barcodes,
+                        const std::function<void(BxBarcodeId, bam1_t *)> &callback);
+    BgzfChunks coalesceChunks(BgzfChunks chunks) const;
+    bool acceptRecord(const bam1_t *b);
+
     bool weird_reads_only;
     int POOR_ALIGNMENT_MAX_MAPQ = 10;
+
+    // exactly one of the two is set
+    std::shared_ptr<const BxBarcodeDictionary> m_dictionary;
+    std::shared_ptr<const BxSidecarIndex> m_sidecar;
+    // Only the BGZF stream is private to the walker. It is shared between
+    // copies of the walker, like the handles of SeqLib::BamReader.
+    std::shared_ptr<htsFile> m_hts_file;
+    std::shared_ptr<BxReadCache> m_cache;
+    std::shared_ptr<BxFetchStats> m_stats;
+
+    // Every barcode block is stored at this fixed position in its contig.
+    static const int BX_BLOCK_BEG = 1;
+    static const int BX_BLOCK_END = 2;
 };
 
 #endif
@@ -0,0 +1,135 @@
+#ifndef BX_BARCODE_H
+#define BX_BARCODE_H
+
+#include "Hashing.h"
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/* Let's distinguish regular strings from BxBarcodes in the source code */
+typedef std::string BxBarcode;
+
+/* Barcodes are interned to 64 bit keys as soon as they are parsed. A 10x
+   barcode is 16 bases and a GEM group suffix (ACGT...ACGT-1), so it packs
+   exactly:
+     bits  0-31  up to 16 bases, 2 bits each
+     bits 32-55  GEM group + 1, or 0 without suffix
+     bits 56-60  number of bases
+   Anything else is hashed, with bit 63 set. "-" and "_" are the same
+   separator, since bxtools convert renames one into the other. 0 is never a
+   valid key and stands for "no barcode".
+*/
+typedef uint64_t BxBarcodeId;
+
+inline BxBarcodeId packBarcode(const char *s, size_t len) {
+  uint64_t bases = 0;
+  size_t i = 0;
+  for (; i < len && i < 16; i++) {
+    uint64_t code;
+    switch (s[i]) {
+    case 'A': code = 0; break;
+    case 'C': code = 1; break;
+    case 'G': code = 2; break;
+    case 'T': code = 3; break;
+    default: code = 4;
+    }
+    if (code == 4)
+      break;
+    bases = (bases << 2) | code;
+  }
+
+  bool packed = i > 0;
+  uint64_t suffix = 0;
+  if (packed && i < len) {
+    packed = (s[i] == '-' || s[i] == '_') && i + 1 < len;
+    for (size_t j = i + 1; packed && j < len; j++) {
+      packed = s[j] >= '0' && s[j] <= '9';
+      suffix = suffix * 10 + (s[j] - '0');
+      packed = packed && suffix < (1 << 24) - 1;
+    }
+    suffix += 1;
+  }
+  if (packed)
+    return ((uint64_t)i << 56) | (suffix << 32) | bases;
+
+  // FNV-1a over the normalized barcode
+  uint64_t h = FNV1A_OFFSET;
+  for (size_t j = 0; j < len; j++)
+    h = fnv1a(h, (uint8_t)(s[j] == '_' ? '-' : s[j]));
+  return h | (1ULL << 63);
+}
+
+inline BxBarcodeId packBarcode(const BxBarcode &bx_barcode) {
+  return packBarcode(bx_barcode.c_str(), bx_barcode.size());
+}
+
+/* Everything a window knows about one of its barcodes */
+struct BxBarcodeInfo {
+  int count = 0;
+  int phase_set = 0;
+  int hap = 0;
+  bool has_phase_set = false;
+  bool has_hap = false;
+};
+
+class BxBarcodeTable {
+  /* Flat open addressing table from barcode keys to their count, phase set
+     and haplotype. Uses linear probing over a power of two capacity. */
+
+public:
+  BxBarcodeTable() : m_size(0) { m_slots.resize(16); }
+
+  // Inserts a zeroed entry if the barcode is new.
+  BxBarcodeInfo &operator[](BxBarcodeId id) {
+    if ((m_size + 1) * 4 > m_slots.size() * 3)
+      grow();
+    Slot &slot = m_slots[probe(id)];
+    if (slot.id == 0) {
+      slot.id = id;
+      m_size++;
+    }
+    return slot.info;
+  }
+
+  const BxBarcodeInfo *find(BxBarcodeId id) const {
+    const Slot &slot = m_slots[probe(id)];
+    return slot.id == 0 ? NULL : &slot.info;
+  }
+
+  size_t size() const { return m_size; }
+
+  template <typename F> void forEach(F f) const {
+    for (const Slot &slot : m_slots)
+      if (slot.id != 0)
+        f(slot.id, slot.info);
+  }
+
+private:
+  struct Slot {
+    BxBarcodeId id = 0;
+    BxBarcodeInfo info;
+  };
+
+  size_t probe(BxBarcodeId id) const {
+    // the low bits of packed keys are poorly mixed
+    size_t mask = m_slots.size() - 1;
+    size_t i = mix64(id) & mask;
+    while (m_slots[i].id != 0 && m_slots[i].id != id)
+      i = (i + 1) & mask;
+    return i;
+  }
+
+  void grow() {
+    std::vector<Slot> old(m_slots.size() * 2);
+    old.swap(m_slots);
+    for (const Slot &slot : old)
+      if (slot.id != 0)
+        m_slots[probe(slot.id)] = slot;
+  }
+
+  std::vector<Slot> m_slots;
+  size_t m_size;
+};
+
+#endif
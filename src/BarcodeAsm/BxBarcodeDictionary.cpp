@@ -0,0 +1,68 @@
+#include "BxBarcodeDictionary.h"
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+
+BxBarcodeDictionary::BxBarcodeDictionary(const std::string &bx_bam_path)
+    : m_index(NULL) {
+  htsFile *fp = hts_open(bx_bam_path.c_str(), "r");
+  if (fp == NULL)
+    throw std::runtime_error("Could not open " + bx_bam_path);
+
+  bam_hdr_t *header = sam_hdr_read(fp);
+  m_index = sam_index_load(fp, bx_bam_path.c_str());
+  hts_close(fp);
+  if (header == NULL || m_index == NULL) {
+    if (header) bam_hdr_destroy(header);
+    if (m_index) hts_idx_destroy(m_index);
+    throw std::runtime_error("Could not load header and index of " + bx_bam_path);
+  }
+
+  // Intern every target name, then order the target IDs by key. The names
+  // themselves are not needed afterwards.
+  m_tid_ids.resize(header->n_targets);
+  std::vector<std::pair<BxBarcodeId, int32_t>> keys(header->n_targets);
+  for (int32_t i = 0; i < header->n_targets; i++) {
+    m_tid_ids[i] = packBarcode(header->target_name[i], strlen(header->target_name[i]));
+    keys[i] = std::make_pair(m_tid_ids[i], i);
+  }
+  bam_hdr_destroy(header);
+  std::sort(keys.begin(), keys.end());
+
+  m_sorted_ids.reserve(keys.size());
+  m_sorted_tids.reserve(keys.size());
+  for (const auto &k : keys) {
+    m_sorted_ids.push_back(k.first);
+    m_sorted_tids.push_back(k.second);
+  }
+
+  std::cerr << "Loaded " << m_sorted_tids.size() << " barcodes from "
+            << bx_bam_path << std::endl;
+}
+
+BxBarcodeDictionary::~BxBarcodeDictionary() {
+  hts_idx_destroy(m_index);
+}
+
+int BxBarcodeDictionary::barcodeToTid(BxBarcodeId bx_barcode) const {
+  auto it = std::lower_bound(m_sorted_ids.begin(), m_sorted_ids.end(), bx_barcode);
+  if (it == m_sorted_ids.end() || *it != bx_barcode)
+    return -1;
+  return m_sorted_tids[it - m_sorted_ids.begin()];
+}
+
+BxBarcodeId BxBarcodeDictionary::tidToBarcodeId(int tid) const {
+  return m_tid_ids[tid];
+}
+
+uint64_t BxBarcodeDictionary::records(int tid) const {
+  uint64_t mapped = 0, unmapped = 0;
+  if (hts_idx_get_stat(m_index, tid, &mapped, &unmapped) != 0)
+    return 0;
+  return mapped + unmapped;
+}
+
+size_t BxBarcodeDictionary::size() const { return m_sorted_tids.size(); }
+
+const hts_idx_t *BxBarcodeDictionary::index() const { return m_index; }
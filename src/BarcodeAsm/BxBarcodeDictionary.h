@@ -0,0 +1,42 @@
+#ifndef BX_BARCODE_DICTIONARY_H
+#define BX_BARCODE_DICTIONARY_H
+
+#include "BxBarcode.h"
+#include "htslib/sam.h"
+#include <memory>
+#include <string>
+#include <vector>
+
+class BxBarcodeDictionary {
+    /* Process-wide lookup of barcodes in the barcode sorted BAM. After bxtools
+       convert, every barcode is a target of the BAM header, so the header can
+       hold millions of entries. It is parsed once, together with the index,
+       and shared read-only by all BxBamWalkers.
+    */
+
+public:
+    BxBarcodeDictionary(const std::string &bx_bam_path);
+    ~BxBarcodeDictionary();
+
+    BxBarcodeDictionary(const BxBarcodeDictionary &) = delete;
+    BxBarcodeDictionary &operator=(const BxBarcodeDictionary &) = delete;
+
+    // Header target ID of this barcode, or -1 if the barcode is absent.
+    int barcodeToTid(BxBarcodeId bx_barcode) const;
+    BxBarcodeId tidToBarcodeId(int tid) const;
+    // Records of the barcode block of a target ID, from the index.
+    uint64_t records(int tid) const;
+    size_t size() const;
+
+    const hts_idx_t *index() const;
+
+private:
+    hts_idx_t *m_index;
+    // sorted barcode keys and their target IDs, for binary search
+    std::vector<BxBarcodeId> m_sorted_ids;
+    std::vector<int32_t> m_sorted_tids;
+    // barcode key of each target ID
+    std::vector<BxBarcodeId> m_tid_ids;
+};
+
+#endif
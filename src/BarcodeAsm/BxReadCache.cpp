@@ -0,0 +1,76 @@
+#include "BxReadCache.h"
+#include "Hashing.h"
+#include <cstring>
+
+BxReadCache::BxReadCache(size_t max_bytes, size_t num_shards)
+    : m_shard_bytes(max_bytes / num_shards), m_hits(0), m_misses(0),
+      m_evictions(0), m_bytes(0) {
+  for (size_t i = 0; i < num_shards; i++)
+    m_shards.emplace_back(new Shard());
+}
+
+BxReadCache::Shard &BxReadCache::shardOf(BxBarcodeId bx_barcode) {
+  return *m_shards[mix64(bx_barcode) % m_shards.size()];
+}
+
+SharedPackedBxRecords BxReadCache::get(BxBarcodeId bx_barcode) {
+  Shard &shard = shardOf(bx_barcode);
+  std::lock_guard<std::mutex> lock(shard.mutex);
+
+  auto it = shard.entries.find(bx_barcode);
+  if (it == shard.entries.end()) {
+    m_misses++;
+    return SharedPackedBxRecords();
+  }
+  m_hits++;
+  // move to the front of the LRU list
+  shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+  return it->second->second;
+}
+
+void BxReadCache::put(BxBarcodeId bx_barcode, SharedPackedBxRecords records) {
+  // the memory held, not just the packed records
+  size_t size = records->capacity();
+  // blocks larger than a shard would evict everything else
+  if (size > m_shard_bytes)
+    return;
+
+  Shard &shard = shardOf(bx_barcode);
+  std::lock_guard<std::mutex> lock(shard.mutex);
+
+  // another thread may have fetched the same barcode in the meantime
+  if (shard.entries.count(bx_barcode) == 1)
+    return;
+
+  while (shard.bytes + size > m_shard_bytes && !shard.lru.empty()) {
+    auto &victim = shard.lru.back();
+    shard.bytes -= victim.second->capacity();
+    m_bytes -= victim.second->capacity();
+    shard.entries.erase(victim.first);
+    shard.lru.pop_back();
+    m_evictions++;
+  }
+
+  shard.lru.emplace_front(bx_barcode, records);
+  shard.entries[bx_barcode] = shard.lru.begin();
+  shard.bytes += size;
+  m_bytes += size;
+}
+
+void BxReadCache::pack(const bam1_t *b, PackedBxRecords &out) {
+  size_t pos = out.size();
+  int32_t l_data = b->l_data;
+  out.resize(pos + sizeof(bam1_core_t) + sizeof(int32_t) + l_data);
+  memcpy(&out[pos], &b->core, sizeof(bam1_core_t));
+  pos += sizeof(bam1_core_t);
+  memcpy(&out[pos], &l_data, sizeof(int32_t));
+  pos += sizeof(int32_t);
+  memcpy(&out[pos], b->data, l_data);
+}
+
+void BxReadCache::writeStats(std::ostream &out) const {
+  uint64_t hits = m_hits, misses = m_misses;
+  out << "Barcode cache hits: " << hits << " misses: " << misses
+      << " hit rate: " << (hits + misses > 0 ? (double)hits / (hits + misses) : 0.0)
+      << " evictions: " << m_evictions << " bytes: " << m_bytes << std::endl;
+}
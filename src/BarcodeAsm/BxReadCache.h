@@ -0,0 +1,85 @@
+#ifndef BX_READ_CACHE_H
+#define BX_READ_CACHE_H
+
+#include "BxBarcode.h"
+#include "htslib/sam.h"
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <unordered_map>
+#include <vector>
+
+/* Records of one barcode block, packed back to back as the bam1_t core, the
+   data length and the variable length data. */
+typedef std::vector<uint8_t> PackedBxRecords;
+typedef std::shared_ptr<const PackedBxRecords> SharedPackedBxRecords;
+
+class BxReadCache {
+    /* Memory bounded cache of barcode blocks, keyed by the barcode.
+       Neighbouring windows share most of their barcodes, so all BxBamWalkers
+       consult this cache before going to disk. The cache is split in shards,
+       each with its own lock and least recently used eviction.
+    */
+
+public:
+    BxReadCache(size_t max_bytes, size_t num_shards = 64);
+
+    // Returns NULL on a miss.
+    SharedPackedBxRecords get(BxBarcodeId bx_barcode);
+    void put(BxBarcodeId bx_barcode, SharedPackedBxRecords records);
+
+    static void pack(const bam1_t *b, PackedBxRecords &out);
+    // Calls f(bam1_t*) for every record in the block. The record is reused.
+    template <typename F> static void unpack(const PackedBxRecords &in, F f);
+
+    void writeStats(std::ostream &out) const;
+
+private:
+    struct Shard {
+        std::mutex mutex;
+        // most recently used entries at the front
+        std::list<std::pair<BxBarcodeId, SharedPackedBxRecords>> lru;
+        std::unordered_map<BxBarcodeId,
+                           std::list<std::pair<BxBarcodeId, SharedPackedBxRecords>>::iterator> entries;
+        size_t bytes = 0;
+    };
+
+    Shard &shardOf(BxBarcodeId bx_barcode);
+
+    size_t m_shard_bytes;
+    std::vector<std::unique_ptr<Shard>> m_shards;
+
+    std::atomic<uint64_t> m_hits;
+    std::atomic<uint64_t> m_misses;
+    std::atomic<uint64_t> m_evictions;
+    std::atomic<uint64_t> m_bytes;
+};
+
+template <typename F> void BxReadCache::unpack(const PackedBxRecords &in, F f) {
+  bam1_t *b = bam_init1();
+  size_t pos = 0;
+  while (pos < in.size()) {
+    memcpy(&b->core, &in[pos], sizeof(bam1_core_t));
+    pos += sizeof(bam1_core_t);
+    int32_t l_data;
+    memcpy(&l_data, &in[pos], sizeof(int32_t));
+    pos += sizeof(int32_t);
+
+    if ((uint32_t)l_data > b->m_data) {
+      b->data = (uint8_t *)realloc(b->data, l_data);
+      b->m_data = l_data;
+    }
+    memcpy(b->data, &in[pos], l_data);
+    b->l_data = l_data;
+    pos += l_data;
+    f(b);
+  }
+  bam_destroy1(b);
+}
+
+#endif
@@ -0,0 +1,282 @@
+#include "BxSidecarIndex.h"
+#include <algorithm>
+#include <cstring>
+#include <exception>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include <thread>
+#include <unordered_map>
+
+namespace {
+
+const char BXI_MAGIC[4] = {'B', 'X', 'I', 1};
+
+typedef std::unordered_map<BxBarcodeId, BgzfChunks> BarcodeChunkMap;
+
+// Extends the last chunk of a barcode up to a chunk starting close to its
+// end, as BxBamWalker coalesces them when fetching.
+void appendChunk(BgzfChunks &chunks, const hts_pair64_t &chunk) {
+  if (!chunks.empty() &&
+      (int64_t)(chunk.u >> 16) - (int64_t)(chunks.back().v >> 16) <= BxSidecarIndex::MAX_CHUNK_GAP)
+    chunks.back().v = std::max(chunks.back().v, chunk.v);
+  else
+    chunks.push_back(chunk);
+}
+
+/* Contiguous range of references [tid_beg, tid_end) read by one thread,
+   starting at virtual offset start (0 for right after the header). */
+struct IndexRange {
+  uint64_t start;
+  int tid_beg;
+  int tid_end;
+  bool last; // also takes the unplaced reads at the end of the file
+};
+
+void indexRange(const std::string &bam_path, IndexRange range, BarcodeChunkMap &out) {
+  htsFile *fp = hts_open(bam_path.c_str(), "r");
+  if (fp == NULL)
+    throw std::runtime_error("Could not open " + bam_path);
+  bam_hdr_t *header = sam_hdr_read(fp);
+  if (header == NULL) {
+    hts_close(fp);
+    throw std::runtime_error("Could not read the header of " + bam_path);
+  }
+  BGZF *bgzf = fp->fp.bgzf;
+  if (range.start != 0 && bgzf_seek(bgzf, range.start, SEEK_SET) < 0) {
+    bam_hdr_destroy(header);
+    hts_close(fp);
+    throw std::runtime_error("Failed to seek in " + bam_path);
+  }
+
+  bam1_t *b = bam_init1();
+  int ret;
+  while (true) {
+    uint64_t beg = bgzf_tell(bgzf);
+    if ((ret = bam_read1(bgzf, b)) < 0)
+      break;
+    uint64_t end = bgzf_tell(bgzf);
+
+    int tid = b->core.tid;
+    if (tid >= 0 && tid < range.tid_beg)
+      continue;
+    if (tid >= range.tid_end || (tid < 0 && !range.last))
+      break;
+
+    uint8_t *bx = bam_aux_get(b, "BX");
+    const char *bx_tag = bx == NULL ? NULL : bam_aux2Z(bx);
+    if (bx_tag == NULL || bx_tag[0] == '\0')
+      continue;
+
+    // nearby records of a barcode extend its last chunk
+    hts_pair64_t chunk;
+    chunk.u = beg;
+    chunk.v = end;
+    appendChunk(out[packBarcode(bx_tag, strlen(bx_tag))], chunk);
+  }
+  bam_destroy1(b);
+  bam_hdr_destroy(header);
+  hts_close(fp);
+  // -1 is the end of the file, anything below is a truncated or corrupt record
+  if (ret < -1)
+    throw std::runtime_error("Failed to read " + bam_path);
+}
+
+// Splits the references in ranges holding roughly the same number of reads.
+std::vector<IndexRange> splitRanges(const std::string &bam_path, int num_threads) {
+  htsFile *fp = hts_open(bam_path.c_str(), "r");
+  if (fp == NULL)
+    throw std::runtime_error("Could not open " + bam_path);
+  bam_hdr_t *header = sam_hdr_read(fp);
+  if (header == NULL) {
+    hts_close(fp);
+    throw std::runtime_error("Could not read the header of " + bam_path);
+  }
+  hts_idx_t *idx = sam_index_load(fp, bam_path.c_str());
+
+  std::vector<IndexRange> ranges;
+  // without an index, one thread reads the whole file
+  if (idx == NULL || num_threads <= 1) {
+    ranges.push_back(IndexRange{0, 0, header->n_targets, true});
+  } else {
+    std::vector<uint64_t> reads(header->n_targets);
+    uint64_t total = 0;
+    for (int tid = 0; tid < header->n_targets; tid++) {
+      uint64_t mapped = 0, unmapped = 0;
+      hts_idx_get_stat(idx, tid, &mapped, &unmapped);
+      reads[tid] = mapped + unmapped;
+      total += reads[tid];
+    }
+
+    int tid = 0;
+    for (int part = 0; part < num_threads && tid < header->n_targets; part++) {
+      IndexRange range{0, tid, tid, part == num_threads - 1};
+      uint64_t range_reads = 0;
+      while (range.tid_end < header->n_targets &&
+             (range.last || range_reads < total / num_threads))
+        range_reads += reads[range.tid_end++];
+      tid = range.tid_end;
+      if (tid == header->n_targets)
+        range.last = true;
+
+      // start at the first record of the first reference that has reads
+      for (int t = range.tid_beg; t < range.tid_end && range.start == 0; t++) {
+        if (reads[t] == 0)
+          continue;
+        hts_itr_t *itr = sam_itr_queryi(idx, t, 0, header->target_len[t]);
+        if (itr != NULL && itr->n_off > 0)
+          range.start = itr->off[0].u;
+        if (itr != NULL)
+          hts_itr_destroy(itr);
+      }
+      if (range_reads > 0 || range.last)
+        ranges.push_back(range);
+    }
+    // The unplaced reads at the end of the file have no index entry. If the
+    // last range has no placed reads, it starts from the header.
+    if (ranges.empty() || !ranges.back().last)
+      ranges.push_back(IndexRange{0, header->n_targets, header->n_targets, true});
+  }
+
+  if (idx != NULL)
+    hts_idx_destroy(idx);
+  bam_hdr_destroy(header);
+  hts_close(fp);
+  return ranges;
+}
+
+template <typename T> void writeValues(std::ofstream &out, const T *values, size_t n) {
+  out.write(reinterpret_cast<const char *>(values), n * sizeof(T));
+}
+
+template <typename T> void readValues(std::ifstream &in, T *values, size_t n) {
+  in.read(reinterpret_cast<char *>(values), n * sizeof(T));
+}
+
+} // namespace
+
+void BxSidecarIndex::build(const std::string &bam_path, const std::string &index_path,
+                           int num_threads) {
+  std::vector<IndexRange> ranges = splitRanges(bam_path, num_threads);
+  std::vector<BarcodeChunkMap> range_chunks(ranges.size());
+
+  // An exception escaping a thread would terminate the process, so the
+  // errors of the ranges are rethrown once all threads are joined.
+  std::vector<std::exception_ptr> errors(ranges.size());
+  std::vector<std::thread> threads;
+  for (size_t i = 0; i < ranges.size(); i++) {
+    threads.emplace_back([&, i]() {
+      try {
+        indexRange(bam_path, ranges[i], range_chunks[i]);
+      } catch (...) {
+        errors[i] = std::current_exception();
+      }
+    });
+  }
+  for (auto &t : threads)
+    t.join();
+  for (auto &e : errors)
+    if (e)
+      std::rethrow_exception(e);
+
+  // Ranges are in file order, so appending keeps the chunks sorted.
+  BarcodeChunkMap &all_chunks = range_chunks[0];
+  for (size_t i = 1; i < range_chunks.size(); i++) {
+    for (auto &c : range_chunks[i]) {
+      BgzfChunks &chunks = all_chunks[c.first];
+      for (auto &chunk : c.second)
+        appendChunk(chunks, chunk);
+    }
+    range_chunks[i].clear();
+  }
+
+  std::vector<BxBarcodeId> ids;
+  ids.reserve(all_chunks.size());
+  for (auto &c : all_chunks)
+    ids.push_back(c.first);
+  std::sort(ids.begin(), ids.end());
+
+  std::vector<uint64_t> first_chunk;
+  first_chunk.reserve(ids.size() + 1);
+  uint64_t num_chunks = 0;
+  for (auto id : ids) {
+    first_chunk.push_back(num_chunks);
+    num_chunks += all_chunks[id].size();
+  }
+  first_chunk.push_back(num_chunks);
+
+  std::ofstream out(index_path, std::ios::binary);
+  uint64_t num_ids = ids.size();
+  out.write(BXI_MAGIC, sizeof(BXI_MAGIC));
+  writeValues(out, &num_ids, 1);
+  writeValues(out, &num_chunks, 1);
+  writeValues(out, ids.data(), ids.size());
+  writeValues(out, first_chunk.data(), first_chunk.size());
+  for (auto id : ids) {
+    for (auto &chunk : all_chunks[id]) {
+      writeValues(out, &chunk.u, 1);
+      writeValues(out, &chunk.v, 1);
+    }
+  }
+  out.close();
+  if (!out)
+    throw std::runtime_error("Could not write " + index_path);
+
+  std::cerr << "Indexed " << num_ids << " barcodes in " << num_chunks
+            << " chunks to " << index_path << std::endl;
+}
+
+std::string BxSidecarIndex::defaultPath(const std::string &bam_path) {
+  return bam_path + ".bxi";
+}
+
+BxSidecarIndex::BxSidecarIndex(const std::string &index_path) {
+  std::ifstream in(index_path, std::ios::binary);
+  char magic[4];
+  in.read(magic, sizeof(magic));
+  if (!in || memcmp(magic, BXI_MAGIC, sizeof(magic)) != 0)
+    throw std::runtime_error(index_path + " is not a barcode index");
+
+  uint64_t num_ids, num_chunks;
+  readValues(in, &num_ids, 1);
+  readValues(in, &num_chunks, 1);
+  m_ids.resize(num_ids);
+  m_first_chunk.resize(num_ids + 1);
+  m_chunks.resize(num_chunks);
+  readValues(in, m_ids.data(), num_ids);
+  readValues(in, m_first_chunk.data(), num_ids + 1);
+  for (auto &chunk : m_chunks) {
+    readValues(in, &chunk.u, 1);
+    readValues(in, &chunk.v, 1);
+  }
+  if (!in)
+    throw std::runtime_error(index_path + " is truncated");
+
+  std::cerr << "Loaded " << num_ids << " barcodes from " << index_path << std::endl;
+}
+
+size_t BxSidecarIndex::find(BxBarcodeId bx_barcode) const {
+  auto it = std::lower_bound(m_ids.begin(), m_ids.end(), bx_barcode);
+  if (it == m_ids.end() || *it != bx_barcode)
+    return m_ids.size();
+  return it - m_ids.begin();
+}
+
+bool BxSidecarIndex::contains(BxBarcodeId bx_barcode) const {
+  return find(bx_barcode) < m_ids.size();
+}
+
+void BxSidecarIndex::appendChunks(BxBarcodeId bx_barcode, BgzfChunks &chunks) const {
+  size_t i = find(bx_barcode);
+  if (i == m_ids.size())
+    return;
+  chunks.insert(chunks.end(), m_chunks.begin() + m_first_chunk[i],
+                m_chunks.begin() + m_first_chunk[i + 1]);
+}
+
+uint64_t BxSidecarIndex::firstOffset(BxBarcodeId bx_barcode) const {
+  size_t i = find(bx_barcode);
+  return i == m_ids.size() ? 0 : m_chunks[m_first_chunk[i]].u;
+}
+
+size_t BxSidecarIndex::size() const { return m_ids.size(); }
@@ -0,0 +1,61 @@
+#ifndef BX_SIDECAR_INDEX_H
+#define BX_SIDECAR_INDEX_H
+
+#include "BxBarcode.h"
+#include "htslib/sam.h"
+#include <string>
+#include <vector>
+
+/* Pairs of BGZF virtual offsets [u, v) delimiting records in the BAM */
+typedef std::vector<hts_pair64_t> BgzfChunks;
+
+class BxSidecarIndex {
+    /* Barcode index of the original, position sorted longranger BAM. It maps
+       every barcode to the BGZF chunks holding its records, so barcodes can be
+       fetched without bxtools convert and a second, barcode sorted BAM.
+
+       The index is written next to the BAM (<bam>.bxi) by BarcodeAsm index:
+         char[4]   magic "BXI\1"
+         uint64    number of barcodes n
+         uint64    number of chunks m
+         uint64[n] barcode keys, sorted
+         uint64[n+1] first chunk of each barcode, and m
+         uint64[2m] chunks as pairs of virtual offsets
+
+       The records of a barcode starting within MAX_CHUNK_GAP compressed
+       bytes of the end of its last chunk extend that chunk, over the records
+       of other barcodes in between. A chunk then covers the reads of a
+       molecule rather than a single record, so the index is loaded in memory
+       at 16 bytes per chunk. A fetch reads each chunk of a barcode in one
+       pass and skips the records of other barcodes.
+    */
+
+public:
+    BxSidecarIndex(const std::string &index_path);
+
+    /* Reads the BAM once, split in contiguous ranges of references between
+       threads, and writes its barcode index to index_path. */
+    static void build(const std::string &bam_path, const std::string &index_path,
+                      int num_threads);
+    static std::string defaultPath(const std::string &bam_path);
+
+    bool contains(BxBarcodeId bx_barcode) const;
+    // Appends the chunks of this barcode, in file order.
+    void appendChunks(BxBarcodeId bx_barcode, BgzfChunks &chunks) const;
+    // Virtual offset of the first record of this barcode.
+    uint64_t firstOffset(BxBarcodeId bx_barcode) const;
+    size_t size() const;
+
+    // Same gap as BxBamWalker::MAX_CHUNK_GAP, so that a fetch inflates the
+    // blocks it would have inflated with one chunk per record.
+    static const int64_t MAX_CHUNK_GAP = 64 * 1024;
+
+private:
+    size_t find(BxBarcodeId bx_barcode) const;
+
+    std::vector<BxBarcodeId> m_ids;
+    std::vector<uint64_t> m_first_chunk;
+    BgzfChunks m_chunks;
+};
+
+#endif
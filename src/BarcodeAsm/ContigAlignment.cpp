@@ -1,6 +1,10 @@
 #include "ContigAlignment.h"
 #include "AlignmentCommon.h"
 #include "SeqLib/UnalignedSequence.h"
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <future>
 #include <ostream>
 #include <sstream>
 #include <utility>
@@ -12,15 +16,12 @@ const std::string ContigAlignment::ALU_REF =
     "GGCGGAGCTTGCAGTGAGCCGAGATCGCGCCACTGCACTCCAGCCTGGGCGACAGAGCGAGACTCCGTCT"
     "C";
 
-ContigMatePairGraph::ContigMatePairGraph(std::unordered_set<std::string> &contigs,
-                                         MatePairContigMap &mate_contig_map) :
-    m_segments(contigs) {
+ContigMatePairGraph::ContigMatePairGraph(const std::vector<std::string> &contigs,
+                                         const std::vector<std::pair<int32_t, int32_t>> &edges) :
+    m_segments(contigs.begin(), contigs.end()) {
 
-    for(auto& b : mate_contig_map) {
-        std::vector<std::string> keys;
-        std::copy(b.second.begin(), b.second.end(), std::back_inserter(keys));
-        m_edges.emplace(keys.at(0), keys.at(1));
-    }
+    for(auto &e : edges)
+        m_edges.emplace(contigs.at(e.first), contigs.at(e.second));
 }
 
 void ContigMatePairGraph::writeGFA(std::ostream &out){
@@ -55,6 +56,7 @@ ContigAlignment::ContigAlignment(const SeqLib::UnalignedSequenceVector &contigs,
   mm_set_opt(0, &m_index_opt, &m_map_opt);
   m_map_opt.flag |= MM_F_CIGAR; // perform alignment
 
+  // k is MINIMIZER_W, as it has always been (see indexLibrary)
   m_minimap_index =
       mm_idx_str(MINIMIZER_W, MINIMIZER_W, IS_HPC, BUCKET_BITS, m_num_seqs,
                  (const char **)m_sequences, (const char **)m_names);
@@ -74,72 +76,98 @@ ContigAlignment::~ContigAlignment() {
   delete m_names;
 }
 
-ContigMatePairGraph ContigAlignment::alignReads(const BamReadVector &reads) {
-  MatePairContigMap read_contig_map;
-  mm_tbuf_t *thread_buf = mm_tbuf_init();
-  for (auto &read : reads) {
-    read_contig_map.emplace(read.Qname(), std::unordered_set<std::string>());
-
-    int num_hits;
-    mm_reg1_t *reg = mm_map(m_minimap_index, read.Sequence().length(), read.Sequence().c_str(),
-               &num_hits, thread_buf, &m_map_opt, read.Qname().c_str());
-
-    if (num_hits > 0) { // include first hit
-      mm_reg1_t *r = &reg[0];
-      assert(r->p); // with MM_F_CIGAR, this should not be NULL
-      read_contig_map[read.Qname()].emplace(std::string(m_minimap_index->seq[r->rid].name));
-          // std::cerr << read.Qname() << " " << read.Sequence().length() << " "
-          // <<
-          //     r->qs << " " << r->qe << " " << "+-"[r->rev] << " " <<
-          //     m_minimap_index->seq[r->rid].name << " " <<
-          //     m_minimap_index->seq[r->rid].len << " " <<
-          //     r->rs << " " << r->re  << " " << r->mlen << " " <<
-          //     r->blen << " " << r->mapq << " " << j << std::endl;
-          // for (i = 0; i < r->p->n_cigar; ++i)
-          //   printf("%d%c", r->p->cigar[i] >> 4, "MIDNSH"[r->p->cigar[i] &
-          //   0xf]);
-      free(r->p);
+std::vector<int32_t> ContigAlignment::mapReads(const ReadStore &reads, AlignmentContext &context,
+                                               int num_threads) const {
+  std::vector<int32_t> read_contigs(reads.size(), -1);
+  std::atomic<uint32_t> next_batch(0);
+
+  // Each thread takes batches of reads until none are left, with its own
+  // buffer. Results go to distinct slots, so no locking is needed.
+  auto map_batches = [this, &reads, &read_contigs, &next_batch](mm_tbuf_t *thread_buf) {
+    std::string seq;
+    for (;;) {
+      uint32_t first = next_batch.fetch_add(READ_BATCH);
+      if (first >= reads.size())
+        break;
+      uint32_t last = std::min<uint64_t>(reads.size(), (uint64_t)first + READ_BATCH);
+      for (uint32_t i = first; i < last; i++) {
+        reads.sequence(i, seq);
+        int num_hits;
+        mm_reg1_t *reg = mm_map(m_minimap_index, seq.length(), seq.c_str(),
+                                &num_hits, thread_buf, &m_map_opt, reads.name(i));
+        if (num_hits > 0) // first hit
+          read_contigs[i] = reg[0].rid;
+        for (int j = 0; j < num_hits; j++)
+          free(reg[j].p);
+        free(reg);
+      }
     }
-    free(reg);
-  }
+  };
+
+  size_t batches = (reads.size() + READ_BATCH - 1) / READ_BATCH;
+  size_t helpers = std::min<size_t>(std::max(num_threads, 1) - 1, batches > 0 ? batches - 1 : 0);
+  std::vector<std::future<void>> mapped;
+  std::vector<mm_tbuf_t *> buffers;
+  for (size_t t = 0; t <= helpers; t++)
+    buffers.push_back(context.buffer(t));
+  for (size_t t = 1; t <= helpers; t++)
+    mapped.push_back(std::async(std::launch::async, map_batches, buffers[t]));
+  map_batches(buffers[0]);
+  for (auto &f : mapped)
+    f.get();
+  return read_contigs;
+}
 
-  // clear empty entries or that are fully within one contig
-  for(auto it = read_contig_map.begin(); it != read_contig_map.end(); ) {
-      if(it -> second.size() != 2)
-          it = read_contig_map.erase(it);
-      else it++;
+ContigMatePairGraph ContigAlignment::buildMateGraph(const ReadStore &reads,
+                                                    const std::vector<int32_t> &read_contigs) const {
+  // first and second contig hit by the reads of each name, -2 once a name
+  // hit a third one
+  std::vector<std::pair<int32_t, int32_t>> name_contigs(reads.nameCount(), std::make_pair(-1, -1));
+  for (uint32_t i = 0; i < reads.size(); i++) {
+    int32_t c = read_contigs[i];
+    if (c < 0)
+      continue;
+    std::pair<int32_t, int32_t> &hit = name_contigs[reads.nameId(i)];
+    if (hit.first == -1)
+      hit.first = c;
+    else if (hit.first == c || hit.second == c || hit.second == -2)
+      continue;
+    else if (hit.second == -1)
+      hit.second = c;
+    else
+      hit.second = -2;
   }
 
+  // names that hit exactly two contigs link them
+  std::vector<std::pair<int32_t, int32_t>> edges;
+  for (auto &hit : name_contigs)
+    if (hit.first >= 0 && hit.second >= 0)
+      edges.push_back(std::make_pair(std::min(hit.first, hit.second),
+                                     std::max(hit.first, hit.second)));
+  std::sort(edges.begin(), edges.end());
+  edges.erase(std::unique(edges.begin(), edges.end()), edges.end());
+
   #ifdef DEBUG_READ_ALIGNMENT
-  for(auto &r : read_contig_map) {
-      std::cerr << r.first << " ";
-      for (auto &c : r.second) std::cerr << c << " ";
-      std::cerr << std::endl;
-  }
+  for(auto &e : edges)
+      std::cerr << m_names[e.first] << " " << m_names[e.second] << std::endl;
   #endif
 
-  mm_tbuf_destroy(thread_buf);
-
-  std::unordered_set<std::string> contigs;
-  for(size_t i = 0; i < m_num_seqs; i++)
-      contigs.emplace(m_names[i]);
+  std::vector<std::string> contigs(m_names, m_names + m_num_seqs);
+  return ContigMatePairGraph(contigs, edges);
+}
 
-  ContigMatePairGraph contig_mate_pair_grah(contigs, read_contig_map);
-  // DISABLE THIS FEATURE FOR NOW
-  // std::ofstream gfa_out(m_prefix + "_mates.gfa");
-  // contig_mate_pair_grah.writeGFA(gfa_out);
-  // gfa_out.close();
-  return contig_mate_pair_grah;
+ContigMatePairGraph ContigAlignment::alignReads(const ReadStore &reads, AlignmentContext &context,
+                                                int num_threads) {
+  return buildMateGraph(reads, mapReads(reads, context, num_threads));
 }
 
-UnitigHits ContigAlignment::alignSequence(SeqLib::UnalignedSequence seq) {
+UnitigHits ContigAlignment::alignSequence(const SeqLib::UnalignedSequence &seq,
+                                          AlignmentContext &context) const {
   UnitigHits unitig_hits;
-  mm_tbuf_t *thread_buf = mm_tbuf_init();
   int num_hits;
-
   mm_reg1_t *reg = mm_map(m_minimap_index, seq.Seq.length(), seq.Seq.c_str(),
-                          &num_hits, thread_buf, &m_map_opt, seq.Name.c_str());
-  for(size_t i = 0; i < num_hits; i++) {
+                          &num_hits, context.buffer(), &m_map_opt, seq.Name.c_str());
+  for (int i = 0; i < num_hits; i++) {
     mm_reg1_t *r = &reg[i];
     assert(r->p); // with MM_F_CIGAR, this should not be NULL
 
@@ -147,37 +175,46 @@ UnitigHits ContigAlignment::alignSequence(SeqLib::UnalignedSequence seq) {
     // query sequence
     hit.unitig_name = m_minimap_index->seq[r->rid].name;
     hit.ql = seq.Seq.length();
-    hit.qs = r -> qs; hit.qe = r->qe;
+    hit.qs = r->qs; hit.qe = r->qe;
 
     // target sequence
     hit.tl = m_minimap_index->seq[r->rid].len;
-    hit.ts = r -> rs; hit.te = r -> re;
-
-    // cigar
-    std::stringstream ss;
-    for (int i = 0; i < r->p->n_cigar; ++i)
-      ss << (r->p->cigar[i] >> 4) << ("MIDNSH"[r->p->cigar[i] & 0xf]);
+    hit.ts = r->rs; hit.te = r->re;
 
     hit.strand = "+-"[r->rev];
-
-    hit.cigar = ss.str();
+    AlignmentContext::appendCigar(r->p, hit.cigar);
     unitig_hits.emplace_back(hit);
 
     free(r->p);
   }
   free(reg);
-  mm_tbuf_destroy(thread_buf);
-
   return unitig_hits;
 }
 
-void ContigAlignment::detectSequences(SeqLib::UnalignedSequenceVector seqs, std::ostream &out) {
-    for(auto &s : seqs) {
-      UnitigHits contig_hits = alignSequence(s);
+void ContigAlignment::writeHits(const SeqLib::UnalignedSequence &seq, AlignmentContext &context,
+                                std::ostream &out) const {
+  UnitigHits contig_hits = alignSequence(seq, context);
 
-      for(auto &hit : contig_hits)
-        out << s.Name << " " << hit.unitig_name << " " << hit.tl << " " << hit.ts
-            << " " << hit.te << " " << hit.ql << " " << hit.qs << " " << hit.qe
-            << " " << hit.strand << " " << hit.cigar << std::endl;
-    }
+  for (auto &hit : contig_hits)
+    out << seq.Name << " " << hit.unitig_name << " " << hit.tl << " " << hit.ts
+        << " " << hit.te << " " << hit.ql << " " << hit.qs << " " << hit.qe
+        << " " << hit.strand << " " << hit.cigar << "\n";
+}
+
+void ContigAlignment::detectSequences(const SeqLib::UnalignedSequenceVector &seqs,
+                                      std::ostream &out, AlignmentContext &context) const {
+  for (auto &s : seqs)
+    writeHits(s, context, out);
+}
+
+void ContigAlignment::detectSequences(const DetectionLibrary &library, std::ostream &out,
+                                      AlignmentContext &context) const {
+  // the others cannot chain enough anchors in a contig to have a hit
+  for (uint32_t s : library.candidates(m_sequences, m_num_seqs, m_map_opt.min_cnt))
+    writeHits(library.sequences()[s], context, out);
+}
+
+DetectionLibrary ContigAlignment::indexLibrary(const SeqLib::UnalignedSequenceVector &seqs) {
+  // mm_map sketches its query with the w, k and flags of the index
+  return DetectionLibrary(seqs, MINIMIZER_W, MINIMIZER_W, IS_HPC);
 }
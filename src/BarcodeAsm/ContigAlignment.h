@@ -2,17 +2,19 @@
 #define READ_ALIGNMENT_H
 
 #include "AlignmentCommon.h"
-#include "BxBamWalker.h"
+#include "AlignmentContext.h"
+#include "DetectionLibrary.h"
+#include "ReadStore.h"
 #include "SeqLib/UnalignedSequence.h"
 #include "minimap2/minimap.h"
 #include <ostream>
 #include <vector>
 #include <string>
 #include <unordered_map>
+#include <unordered_set>
 
-typedef std::unordered_map<std::string, std::unordered_set<std::string>> MatePairContigMap;
-typedef std::pair<std::string, std::string> Edge;
 typedef std::vector<UnitigHit> UnitigHits;
+typedef std::pair<std::string, std::string> Edge;
 
 struct EdgeHash {
   // Property: return the same value for <s1, s2> and <s2, s1>.
@@ -26,8 +28,9 @@ struct EdgeHash {
 
 class ContigMatePairGraph {
 public:
-    ContigMatePairGraph(std::unordered_set<std::string> &contigs,
-                        MatePairContigMap &mate_contig_map);
+    // Edges are pairs of positions into contigs.
+    ContigMatePairGraph(const std::vector<std::string> &contigs,
+                        const std::vector<std::pair<int32_t, int32_t>> &edges);
 
     void writeGFA(std::ostream &out);
 private:
@@ -40,20 +43,42 @@ public:
     ContigAlignment(const SeqLib::UnalignedSequenceVector &contigs, const std::string &prefix);
     ~ContigAlignment();
 
-    ContigMatePairGraph alignReads(const BamReadVector &reads);
-    UnitigHits alignSequence(SeqLib::UnalignedSequence seq);
-    void detectSequences(SeqLib::UnalignedSequenceVector seqs,std::ostream &out);
+    // Contig of the best hit of each read, -1 for unmapped reads. Batches of
+    // reads are mapped by num_threads threads, including the calling one.
+    std::vector<int32_t> mapReads(const ReadStore &reads, AlignmentContext &context,
+                                  int num_threads = 1) const;
+    // Links the two contigs hit by the reads of a name, for names whose reads
+    // hit exactly two contigs.
+    ContigMatePairGraph buildMateGraph(const ReadStore &reads,
+                                       const std::vector<int32_t> &read_contigs) const;
+    ContigMatePairGraph alignReads(const ReadStore &reads, AlignmentContext &context,
+                                   int num_threads = 1);
+    // Hits of a sequence in the contigs, with the sequence as query.
+    UnitigHits alignSequence(const SeqLib::UnalignedSequence &seq, AlignmentContext &context) const;
+    // Writes the hits of each sequence in the contigs, one line per hit.
+    void detectSequences(const SeqLib::UnalignedSequenceVector &seqs, std::ostream &out,
+                         AlignmentContext &context) const;
+    // Same, for the sequences of the library that can hit the contigs.
+    void detectSequences(const DetectionLibrary &library, std::ostream &out,
+                         AlignmentContext &context) const;
+    // Library whose minimizers are those of queries against the contig index.
+    static DetectionLibrary indexLibrary(const SeqLib::UnalignedSequenceVector &seqs);
 
     // default minimap2 parameters
-    const int MINIMIZER_K = 15;
-    const int MINIMIZER_W = 10;
-    const int BUCKET_BITS = 64;
-    const int IS_HPC = 0;
+    static const int MINIMIZER_K = 15;
+    static const int MINIMIZER_W = 10;
+    static const int BUCKET_BITS = 64;
+    static const int IS_HPC = 0;
+    // reads taken at once by a mapping thread
+    static const uint32_t READ_BATCH = 256;
 
     // Reference ALU sequence, used for detecting contigs with potential Alu
     // inserts
     static const std::string ALU_REF;
 private:
+    void writeHits(const SeqLib::UnalignedSequence &seq, AlignmentContext &context,
+                   std::ostream &out) const;
+
     std::string m_prefix;
     char** m_sequences;         // contigs to be aligned
     char** m_names;             // names of contigs
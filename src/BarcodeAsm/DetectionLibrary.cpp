@@ -0,0 +1,64 @@
+#include "DetectionLibrary.h"
+#include "minimap2/mmpriv.h"
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+
+DetectionLibrary::DetectionLibrary(const SeqLib::UnalignedSequenceVector &seqs, int w, int k,
+                                   bool is_hpc)
+    : m_sequences(seqs), m_w(w), m_k(k), m_is_hpc(is_hpc) {
+  std::vector<uint64_t> hashes;
+  for (uint32_t s = 0; s < m_sequences.size(); s++) {
+    hashes.clear();
+    sketch(m_sequences[s].Seq.c_str(), m_sequences[s].Seq.size(), hashes);
+    for (uint64_t h : hashes)
+      m_minimizers.push_back(Minimizer{h, s});
+  }
+  std::sort(m_minimizers.begin(), m_minimizers.end());
+}
+
+const SeqLib::UnalignedSequenceVector &DetectionLibrary::sequences() const { return m_sequences; }
+
+bool DetectionLibrary::empty() const { return m_sequences.empty(); }
+
+void DetectionLibrary::sketch(const char *seq, size_t len, std::vector<uint64_t> &hashes) const {
+  // mm_sketch appends to the vector, and allocates it with malloc
+  mm128_v mins = {0, 0, NULL};
+  mm_sketch(NULL, seq, len, m_w, m_k, 0, m_is_hpc, &mins);
+  for (size_t i = 0; i < mins.n; i++)
+    hashes.push_back(mins.a[i].x >> 8); // the low bits hold the span
+  free(mins.a);
+}
+
+std::vector<uint32_t> DetectionLibrary::candidates(const char *const *seqs, size_t n,
+                                                   int min_anchors) const {
+  std::vector<uint32_t> anchors(m_sequences.size(), 0);
+  std::vector<bool> is_candidate(m_sequences.size(), false);
+  std::vector<uint32_t> touched;
+  std::vector<uint64_t> hashes;
+  for (size_t i = 0; i < n; i++) {
+    // a chain is within one contig
+    hashes.clear();
+    sketch(seqs[i], strlen(seqs[i]), hashes);
+    std::sort(hashes.begin(), hashes.end());
+    hashes.erase(std::unique(hashes.begin(), hashes.end()), hashes.end());
+    for (uint64_t h : hashes)
+      for (auto it = std::lower_bound(m_minimizers.begin(), m_minimizers.end(), Minimizer{h, 0});
+           it != m_minimizers.end() && it->hash == h; ++it) {
+        if (anchors[it->seq]++ == 0)
+          touched.push_back(it->seq);
+      }
+    for (uint32_t s : touched) {
+      if (anchors[s] >= (uint32_t)std::max(min_anchors, 1))
+        is_candidate[s] = true;
+      anchors[s] = 0;
+    }
+    touched.clear();
+  }
+
+  std::vector<uint32_t> ids;
+  for (uint32_t s = 0; s < m_sequences.size(); s++)
+    if (is_candidate[s])
+      ids.push_back(s);
+  return ids;
+}
@@ -0,0 +1,54 @@
+#ifndef DETECTION_LIBRARY_H
+#define DETECTION_LIBRARY_H
+
+#include "SeqLib/UnalignedSequence.h"
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+class DetectionLibrary {
+  /* The sequences given with -F, loaded once at startup and shared read-only
+     by all workers, with an index of their minimizers. The minimizers are
+     computed like minimap2 does for a query mapped against a contig index.
+
+     minimap2 only reports a hit of a query in a contig for a chain of at
+     least min_cnt anchors, each a minimizer of the query, at its own query
+     position, that is also a minimizer of the contig. A window thus only
+     maps the library sequences with that many minimizer positions found in
+     one of its contigs, against its contig index as before. hits.tsv is the
+     same as when all of them are mapped, while the others cost a lookup per
+     contig minimizer instead of a mapping each.
+  */
+
+public:
+  // w, k and is_hpc are those of the contig index.
+  DetectionLibrary(const SeqLib::UnalignedSequenceVector &seqs, int w, int k, bool is_hpc);
+
+  const SeqLib::UnalignedSequenceVector &sequences() const;
+  bool empty() const;
+  // Library sequences with at least min_anchors minimizer positions whose
+  // minimizer is one of a single sequence of seqs, by increasing position in
+  // the library.
+  std::vector<uint32_t> candidates(const char *const *seqs, size_t n, int min_anchors) const;
+
+private:
+  // Minimizer hashes of the sequence, one per position.
+  void sketch(const char *seq, size_t len, std::vector<uint64_t> &hashes) const;
+
+  struct Minimizer {
+    uint64_t hash;
+    uint32_t seq; // position in m_sequences
+    bool operator<(const Minimizer &o) const {
+      return hash < o.hash || (hash == o.hash && seq < o.seq);
+    }
+  };
+
+  SeqLib::UnalignedSequenceVector m_sequences;
+  int m_w;
+  int m_k;
+  bool m_is_hpc;
+  // one entry per minimizer position of each library sequence, sorted
+  std::vector<Minimizer> m_minimizers;
+};
+
+#endif
@@ -0,0 +1,31 @@
+#ifndef HASHING_H
+#define HASHING_H
+
+#include <cstddef>
+#include <cstdint>
+
+/* Hash functions shared by the flat tables and the read keys. None of them
+   is meant to resist adversarial input. */
+
+// splitmix64 finalizer. Spreads every input bit over the whole word, so the
+// low bits can index a power of two table even for poorly mixed keys.
+inline uint64_t mix64(uint64_t h) {
+  h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+  return h ^ (h >> 31);
+}
+
+// FNV-1a, fed one byte at a time from FNV1A_OFFSET.
+static const uint64_t FNV1A_OFFSET = 14695981039346656037ULL;
+
+inline uint64_t fnv1a(uint64_t h, uint8_t byte) { return (h ^ byte) * 1099511628211ULL; }
+
+// FNV-1a of a NUL terminated string
+inline uint64_t fnv1a(const char *s) {
+  uint64_t h = FNV1A_OFFSET;
+  for (; *s; s++)
+    h = fnv1a(h, (uint8_t)*s);
+  return h;
+}
+
+#endif
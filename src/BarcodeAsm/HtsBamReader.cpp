@@ -0,0 +1,74 @@
+#include "HtsBamReader.h"
+#include <algorithm>
+#include <iostream>
+
+HtsBamReader::HtsBamReader() : m_region_set(false) {}
+
+bool HtsBamReader::Open(const std::string &bam_path) {
+  m_fp = std::shared_ptr<htsFile>(hts_open(bam_path.c_str(), "r"),
+                                  [](htsFile *f) { if (f) hts_close(f); });
+  if (!m_fp)
+    return false;
+  m_hdr = std::shared_ptr<bam_hdr_t>(sam_hdr_read(m_fp.get()),
+                                     [](bam_hdr_t *h) { if (h) bam_hdr_destroy(h); });
+  if (!m_hdr)
+    return false;
+  m_header = SeqLib::BamHeader(m_hdr.get());
+  // a missing index only matters once a region is set
+  m_idx = std::shared_ptr<hts_idx_t>(sam_index_load(m_fp.get(), bam_path.c_str()),
+                                     [](hts_idx_t *i) { if (i) hts_idx_destroy(i); });
+  return true;
+}
+
+void HtsBamReader::setThreadPool(htsThreadPool *pool) {
+  if (m_fp && pool != NULL && pool->pool != NULL)
+    hts_set_opt(m_fp.get(), HTS_OPT_THREAD_POOL, pool);
+}
+
+SeqLib::BamHeader HtsBamReader::Header() const { return m_header; }
+
+bool HtsBamReader::SetRegion(const SeqLib::GenomicRegion &region) {
+  m_region_set = true;
+  if (!m_idx) {
+    std::cerr << "Cannot set a region without a BAM index" << std::endl;
+    m_itr.reset();
+    return false;
+  }
+  m_itr = std::shared_ptr<hts_itr_t>(sam_itr_queryi(m_idx.get(), region.chr, region.pos1, region.pos2),
+                                     [](hts_itr_t *i) { if (i) hts_itr_destroy(i); });
+  return (bool)m_itr;
+}
+
+uint64_t HtsBamReader::estimateRegionBytes(const SeqLib::GenomicRegion &region) const {
+  if (!m_idx)
+    return 0;
+  hts_itr_t *itr = sam_itr_queryi(m_idx.get(), region.chr, region.pos1, region.pos2);
+  if (itr == NULL)
+    return 0;
+  uint64_t bytes = 0;
+  for (int i = 0; i < itr->n_off; i++) {
+    int64_t span = (int64_t)(itr->off[i].v >> 16) - (int64_t)(itr->off[i].u >> 16) +
+                   (int64_t)(itr->off[i].v & 0xffff) - (int64_t)(itr->off[i].u & 0xffff);
+    bytes += std::max<int64_t>(span, 0);
+  }
+  hts_itr_destroy(itr);
+  return bytes;
+}
+
+bool HtsBamReader::GetNextRecord(SeqLib::BamRecord &r) {
+  bam1_t *b = bam_init1();
+  if (!GetNextRecord(b)) {
+    bam_destroy1(b);
+    return false;
+  }
+  r.assign(b);
+  return true;
+}
+
+bool HtsBamReader::GetNextRecord(bam1_t *b) {
+  if (m_region_set && !m_itr)
+    return false;
+  int ret = m_itr ? sam_itr_next(m_fp.get(), m_itr.get(), b)
+                  : sam_read1(m_fp.get(), m_hdr.get(), b);
+  return ret >= 0;
+}
@@ -0,0 +1,47 @@
+#ifndef HTS_BAM_READER_H
+#define HTS_BAM_READER_H
+
+#include "SeqLib/BamHeader.h"
+#include "SeqLib/BamRecord.h"
+#include "SeqLib/GenomicRegion.h"
+#include "htslib/sam.h"
+#include "htslib/thread_pool.h"
+#include <memory>
+#include <string>
+
+class HtsBamReader {
+    /* Indexed BAM reader with the subset of the SeqLib::BamReader interface
+       used by the local assembly windows. Unlike SeqLib::BamReader, its htslib
+       handle is reachable, so that BGZF decompression can be handed to a
+       thread pool shared by all readers of the process. Copies of a reader
+       share its handles.
+    */
+
+public:
+    HtsBamReader();
+
+    bool Open(const std::string &bam_path);
+    // The pool must outlive the reader.
+    void setThreadPool(htsThreadPool *pool);
+
+    SeqLib::BamHeader Header() const;
+    bool SetRegion(const SeqLib::GenomicRegion &region);
+    bool GetNextRecord(SeqLib::BamRecord &r);
+    // Reads into a caller owned record, which can be reused between calls.
+    bool GetNextRecord(bam1_t *b);
+    // Size of the BAM the index points to for a region, without reading it.
+    // Counts compressed bytes between blocks and uncompressed bytes within
+    // one, so it is only good for comparing regions. 0 without an index.
+    uint64_t estimateRegionBytes(const SeqLib::GenomicRegion &region) const;
+
+private:
+    std::shared_ptr<htsFile> m_fp;
+    std::shared_ptr<bam_hdr_t> m_hdr;
+    std::shared_ptr<hts_idx_t> m_idx;
+    std::shared_ptr<hts_itr_t> m_itr;
+    SeqLib::BamHeader m_header;
+    // once a region is set, reads only come from its iterator
+    bool m_region_set;
+};
+
+#endif
@@ -0,0 +1,95 @@
+#include "KmerFilter.h"
+#include <algorithm>
+#include <cctype>
+
+KmerRelevanceFilter::KmerRelevanceFilter(int k, int min_shared, int rounds)
+    : m_k(std::max(1, std::min(k, 31))), m_min_shared(std::max(1, min_shared)),
+      m_rounds(std::max(1, rounds)), m_rounds_run(0) {}
+
+template <typename F>
+bool KmerRelevanceFilter::forEachKmer(const uint8_t *codes, size_t len, F f) const {
+  const uint64_t mask = (1ULL << (2 * m_k)) - 1;
+  const int shift = 2 * (m_k - 1);
+  uint64_t fwd = 0, rev = 0;
+  int run = 0; // bases since the last ambiguous one
+  for (size_t j = 0; j < len; j++) {
+    uint64_t c = codes[j];
+    if (c > 3) {
+      run = 0;
+      continue;
+    }
+    fwd = ((fwd << 2) | c) & mask;
+    rev = (rev >> 2) | ((3 - c) << shift);
+    if (++run >= m_k && !f(std::min(fwd, rev)))
+      return false;
+  }
+  return true;
+}
+
+void KmerRelevanceFilter::addCodes(const uint8_t *codes, size_t len) {
+  forEachKmer(codes, len, [this](uint64_t kmer) {
+    m_kmers.insert(kmer);
+    return true;
+  });
+}
+
+bool KmerRelevanceFilter::isRelevant(const uint8_t *codes, size_t len) const {
+  int shared = 0;
+  // stops at the first min_shared hits
+  return !forEachKmer(codes, len, [this, &shared](uint64_t kmer) {
+    return !(m_kmers.contains(kmer) && ++shared >= m_min_shared);
+  });
+}
+
+void KmerRelevanceFilter::addSequence(const std::string &seq) {
+  m_codes.resize(seq.size());
+  for (size_t j = 0; j < seq.size(); j++) {
+    switch (toupper(seq[j])) {
+    case 'A': m_codes[j] = 0; break;
+    case 'C': m_codes[j] = 1; break;
+    case 'G': m_codes[j] = 2; break;
+    case 'T': m_codes[j] = 3; break;
+    default: m_codes[j] = 4;
+    }
+  }
+  addCodes(m_codes.data(), m_codes.size());
+}
+
+void KmerRelevanceFilter::addRead(const ReadStore &reads, uint32_t i) {
+  reads.codes(i, m_codes);
+  addCodes(m_codes.data(), m_codes.size());
+}
+
+std::vector<bool> KmerRelevanceFilter::select(const ReadStore &reads, uint32_t first_candidate) {
+  std::vector<bool> keep(reads.size(), false);
+  for (uint32_t i = 0; i < first_candidate && i < reads.size(); i++) {
+    keep[i] = true;
+    addRead(reads, i);
+  }
+
+  m_rounds_run = 0;
+  for (int round = 0; round < m_rounds; round++) {
+    std::vector<uint32_t> recruited;
+    for (uint32_t i = first_candidate; i < reads.size(); i++) {
+      if (keep[i])
+        continue;
+      reads.codes(i, m_codes);
+      if (isRelevant(m_codes.data(), m_codes.size()))
+        recruited.push_back(i);
+    }
+    if (recruited.empty())
+      break;
+    m_rounds_run++;
+    for (uint32_t i : recruited) {
+      keep[i] = true;
+      // only needed if there is another round to recruit for
+      if (round + 1 < m_rounds)
+        addRead(reads, i);
+    }
+  }
+  return keep;
+}
+
+int KmerRelevanceFilter::roundsRun() const { return m_rounds_run; }
+
+size_t KmerRelevanceFilter::kmers() const { return m_kmers.size(); }
@@ -0,0 +1,91 @@
+#ifndef KMER_FILTER_H
+#define KMER_FILTER_H
+
+#include "Hashing.h"
+#include "ReadStore.h"
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+class KmerSet {
+    /* Flat open addressing set of canonical k-mers packed at 2 bits per
+       base (k <= 31). Keys are stored with bit 63 set, so that 0 marks an
+       empty slot, in one contiguous array probed linearly: a probe rarely
+       leaves its cache line. */
+
+public:
+    KmerSet() : m_size(0) { m_slots.resize(1 << 12); }
+
+    void insert(uint64_t kmer) {
+        if ((m_size + 1) * 2 > m_slots.size())
+            grow();
+        uint64_t &slot = m_slots[probe(kmer | KEY_BIT)];
+        if (slot == 0) {
+            slot = kmer | KEY_BIT;
+            m_size++;
+        }
+    }
+
+    bool contains(uint64_t kmer) const { return m_slots[probe(kmer | KEY_BIT)] != 0; }
+
+    size_t size() const { return m_size; }
+
+private:
+    static const uint64_t KEY_BIT = 1ULL << 63;
+
+    size_t probe(uint64_t key) const {
+        size_t mask = m_slots.size() - 1;
+        size_t i = mix64(key) & mask;
+        while (m_slots[i] != 0 && m_slots[i] != key)
+            i = (i + 1) & mask;
+        return i;
+    }
+
+    void grow() {
+        std::vector<uint64_t> old(m_slots.size() * 2, 0);
+        old.swap(m_slots);
+        for (uint64_t key : old)
+            if (key != 0)
+                m_slots[probe(key)] = key;
+    }
+
+    std::vector<uint64_t> m_slots;
+    size_t m_size;
+};
+
+class KmerRelevanceFilter {
+    /* Keeps the barcode reads that are relevant to a window: those sharing
+       at least min_shared k-mers with the local reads, and optionally with
+       the reference of the window. Recruited reads add their k-mers for the
+       next round, so that reads reaching further into an insertion can be
+       recruited by the reads that overlap its edges.
+    */
+
+public:
+    KmerRelevanceFilter(int k, int min_shared, int rounds);
+
+    void addSequence(const std::string &seq);
+    void addRead(const ReadStore &reads, uint32_t i);
+    // Reads before first_candidate are always kept and seed the k-mer set.
+    std::vector<bool> select(const ReadStore &reads, uint32_t first_candidate);
+
+    // rounds that recruited reads in the last select
+    int roundsRun() const;
+    size_t kmers() const;
+
+private:
+    void addCodes(const uint8_t *codes, size_t len);
+    bool isRelevant(const uint8_t *codes, size_t len) const;
+    // Calls f with the canonical k-mers of a sequence of 2-bit codes.
+    template <typename F> bool forEachKmer(const uint8_t *codes, size_t len, F f) const;
+
+    int m_k;
+    int m_min_shared;
+    int m_rounds;
+    int m_rounds_run;
+    KmerSet m_kmers;
+    std::vector<uint8_t> m_codes; // reused decoding buffer
+};
+
+#endif
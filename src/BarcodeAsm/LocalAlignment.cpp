@@ -1,89 +1,142 @@
 #include "LocalAlignment.h"
+#include <stdexcept>
 
 LocalAlignment::LocalAlignment(std::string chr, size_t start, size_t end,
-                               const SeqLib::RefGenome &genome)
+                               const ReferenceGenome &genome, AlignmentContext &context,
+                               LocalAligner aligner)
+    : m_reference_index(NULL), m_target_rid(0), m_target_start(0)
 {
-    std::string region = genome.QueryRegion(chr, start, end);
     // identifier for the target aligned region
     std::stringstream s;
     s << chr << "_" << start << "_" << end;
     m_target_name = s.str();
 
-    setupIndex(region);
+    std::string &region = context.referenceBuffer();
+    if (!genome.fetch(chr, start, end, region))
+        throw std::invalid_argument("No reference sequence named " + chr);
+    if (region.empty())
+        throw std::invalid_argument("No reference sequence in " + m_target_name);
+
+    if (aligner == ALIGNER_BANDED) {
+      m_minimap_index = NULL;
+      m_banded_aligner.reset(new BandedAligner(
+          region, m_params.minimizer_k, m_params.a, m_params.b, m_params.q, m_params.e,
+          m_params.q2, m_params.e2, m_params.bw, m_params.zdrop, m_params.end_bonus));
+      m_target_length = region.size();
+      m_target_end = m_target_length - 1;
+    } else {
+      setupIndex(region);
+    }
 }
 
-LocalAlignment::LocalAlignment(std::string target_sequence, std::string target_name) : m_target_name(target_name) {
+LocalAlignment::LocalAlignment(std::string target_sequence, std::string target_name)
+    : m_target_name(target_name), m_reference_index(NULL), m_target_rid(0), m_target_start(0) {
   setupIndex(target_sequence);
 }
 
-void LocalAlignment::setupIndex(std::string target_sequence) {
-  m_local_sequence = new char[target_sequence.size() + 1];
-  memcpy(m_local_sequence, target_sequence.c_str(), target_sequence.size() + 1);
+LocalAlignment::LocalAlignment(std::string chr, size_t start, size_t end,
+                               const ReferenceIndex &index, size_t flank)
+    : m_minimap_index(NULL), m_reference_index(&index),
+      m_target_rid(index.chromosome(chr)) {
+  if (m_target_rid < 0)
+    throw std::invalid_argument("No reference sequence named " + chr);
+  m_target_start = start > flank ? start - flank : 0;
+  m_target_end = end + flank;
+  if (m_target_end >= index.length(m_target_rid))
+    m_target_end = index.length(m_target_rid) - 1;
+
+  // identifier for the target aligned region
+  std::stringstream s;
+  s << chr << "_" << m_target_start << "_" << m_target_end;
+  m_target_name = s.str();
+  if (index.length(m_target_rid) == 0 || m_target_start > m_target_end)
+    throw std::invalid_argument("No reference sequence in " + m_target_name);
+  m_target_length = m_target_end - m_target_start + 1;
+}
 
-  mm_set_opt(0, &m_index_opt, &m_map_opt);
-  m_map_opt.flag |= MM_F_CIGAR; // perform base level alignment
+mm_mapopt_t LocalAlignment::makeMapOpt(const LocalAlignmentParams &params) {
+  mm_idxopt_t index_opt;
+  mm_mapopt_t map_opt;
+  mm_set_opt(0, &index_opt, &map_opt);
+  map_opt.flag |= MM_F_CIGAR; // perform base level alignment
 
   // tune minimap for large gaps
-  m_map_opt.max_join_short = m_params.max_join_short;
-  m_map_opt.max_join_long = m_params.max_join_long;
-  m_map_opt.min_join_flank_sc = m_params.min_join_flank_sc;
-  m_map_opt.min_join_flank_ratio = m_params.min_join_flank_ratio;
-  m_map_opt.max_gap = m_params.max_gap;
-  m_map_opt.bw = m_params.bw;
-  m_map_opt.pri_ratio = m_params.pri_ratio;
-  m_map_opt.max_chain_skip = m_params.max_chain_skip;
-  m_map_opt.end_bonus = m_params.end_bonus;
-  m_map_opt.chain_gap_scale = m_params.chain_gap_scale;
-  m_map_opt.min_chain_score = m_params.min_chain_score;
-  m_map_opt.e = m_params.e;
-  m_map_opt.e2 = m_params.e2;
-  m_map_opt.q = m_params.q;
-  m_map_opt.q2 = m_params.q2;
-  m_map_opt.max_chain_iter = m_params.max_chain_iter;
-  m_map_opt.max_clip_ratio = m_params.max_clip_ratio;
-  m_map_opt.zdrop = m_params.zdrop;
-  m_map_opt.zdrop_inv = m_params.zdrop_inv;
-  m_map_opt.max_gap_ref = m_params.max_gap_ref;
-  m_map_opt.a = m_params.a;
-  m_map_opt.b = m_params.b;
+  map_opt.max_join_short = params.max_join_short;
+  map_opt.max_join_long = params.max_join_long;
+  map_opt.min_join_flank_sc = params.min_join_flank_sc;
+  map_opt.min_join_flank_ratio = params.min_join_flank_ratio;
+  map_opt.max_gap = params.max_gap;
+  map_opt.bw = params.bw;
+  map_opt.pri_ratio = params.pri_ratio;
+  map_opt.max_chain_skip = params.max_chain_skip;
+  map_opt.end_bonus = params.end_bonus;
+  map_opt.chain_gap_scale = params.chain_gap_scale;
+  map_opt.min_chain_score = params.min_chain_score;
+  map_opt.e = params.e;
+  map_opt.e2 = params.e2;
+  map_opt.q = params.q;
+  map_opt.q2 = params.q2;
+  map_opt.max_chain_iter = params.max_chain_iter;
+  map_opt.max_clip_ratio = params.max_clip_ratio;
+  map_opt.zdrop = params.zdrop;
+  map_opt.zdrop_inv = params.zdrop_inv;
+  map_opt.max_gap_ref = params.max_gap_ref;
+  map_opt.a = params.a;
+  map_opt.b = params.b;
 
 #ifdef DEBUG_LOCAL_ALN
-  std::cerr << "max_join_short: " << m_params.max_join_short << std::endl
-            << "max_join_long: " << m_params.max_join_long << std::endl
-            << "min_join_flank_sc: " << m_params.min_join_flank_sc << std::endl
-            << "min_join_flank_ratio: " << m_params.min_join_flank_ratio << std::endl
-            << "max_gap: " << m_params.max_gap << std::endl
-            << "max_gap_ref: " << m_params.max_gap_ref << std::endl
-            << "bw: " << m_params.bw << std::endl
-            << "pri_ratio: " << m_params.pri_ratio << std::endl
-            << "max_chain_skip: " << m_params.max_chain_skip << std::endl
-            << "max_chain_iter: " << m_params.max_chain_iter << std::endl
-            << "min_chain_score: " << m_params.min_chain_score << std::endl
-            << "chain_gap_scale: " << m_params.chain_gap_scale << std::endl
-            << "a: " << m_params.a << " b: " << m_params.b << std::endl
-            << "e: " << m_params.e << " e2: " << m_params.e2 << std::endl
-            << "q: " << m_params.q << " q2: " << m_params.q2 << std::endl
-            << "end_bonus: " << m_params.end_bonus << std::endl
-            << "max_clip_ratio: " << m_params.max_clip_ratio << std::endl
-            << "zdrop: " << m_params.zdrop << " zdrop_inv: " << m_params.zdrop_inv << std::endl
-            << "minimizer_w " << m_params.minimizer_w << " minimizer_k: " << m_params.minimizer_k << std::endl
-            << "bucket_bits: " << m_params.bucket_bits << std::endl
-            << "is_hpc: " << m_params.is_hpc << std::endl;
+  std::cerr << "max_join_short: " << params.max_join_short << std::endl
+            << "max_join_long: " << params.max_join_long << std::endl
+            << "min_join_flank_sc: " << params.min_join_flank_sc << std::endl
+            << "min_join_flank_ratio: " << params.min_join_flank_ratio << std::endl
+            << "max_gap: " << params.max_gap << std::endl
+            << "max_gap_ref: " << params.max_gap_ref << std::endl
+            << "bw: " << params.bw << std::endl
+            << "pri_ratio: " << params.pri_ratio << std::endl
+            << "max_chain_skip: " << params.max_chain_skip << std::endl
+            << "max_chain_iter: " << params.max_chain_iter << std::endl
+            << "min_chain_score: " << params.min_chain_score << std::endl
+            << "chain_gap_scale: " << params.chain_gap_scale << std::endl
+            << "a: " << params.a << " b: " << params.b << std::endl
+            << "e: " << params.e << " e2: " << params.e2 << std::endl
+            << "q: " << params.q << " q2: " << params.q2 << std::endl
+            << "end_bonus: " << params.end_bonus << std::endl
+            << "max_clip_ratio: " << params.max_clip_ratio << std::endl
+            << "zdrop: " << params.zdrop << " zdrop_inv: " << params.zdrop_inv << std::endl
+            << "minimizer_w " << params.minimizer_w << " minimizer_k: " << params.minimizer_k << std::endl
+            << "bucket_bits: " << params.bucket_bits << std::endl
+            << "is_hpc: " << params.is_hpc << std::endl;
 #endif
+  return map_opt;
+}
+
+const mm_mapopt_t &LocalAlignment::tunedMapOpt() {
+  static const mm_mapopt_t map_opt = makeMapOpt(LocalAlignmentParams());
+  return map_opt;
+}
+
+void LocalAlignment::setupIndex(const std::string &target_sequence) {
+  // minimap2 packs its own copy of the sequence
+  const char *sequence = target_sequence.c_str();
+
+  // the tuned options are set up once for all windows
+  m_map_opt = tunedMapOpt();
   m_minimap_index = mm_idx_str(m_params.minimizer_w,
                                m_params.minimizer_k,
                                m_params.is_hpc,
                                m_params.bucket_bits, 1,
-                               (const char **)&m_local_sequence, NULL);
+                               &sequence, NULL);
   // update the mapping options
   mm_mapopt_update(&m_map_opt, m_minimap_index);
   mm_idx_stat(m_minimap_index);
+  m_target_length = m_minimap_index->seq->len;
+  m_target_end = m_target_length - 1;
 }
 
 LocalAlignment::~LocalAlignment() {
   // free allocated memory
-  mm_idx_destroy(m_minimap_index);
-  free(m_local_sequence);
+  if (m_minimap_index)
+    mm_idx_destroy(m_minimap_index);
 
   for (auto &aln : m_alignments) {
     for (int j = 0; j < aln.second.num_hits; ++j)
@@ -92,16 +145,113 @@ LocalAlignment::~LocalAlignment() {
   }
 }
 
-void LocalAlignment::align(const SeqLib::UnalignedSequenceVector &seqs) {
-  mm_tbuf_t *thread_buf = mm_tbuf_init();
+void LocalAlignment::keepTargetHits(MinimapAlignment &alignment) const {
+  int kept = 0;
+  for (int j = 0; j < alignment.num_hits; ++j) {
+    mm_reg1_t &r = alignment.reg[j];
+    if (r.rid == m_target_rid && clipHit(r, m_target_start, m_target_end + 1))
+      alignment.reg[kept++] = r;
+    else
+      free(r.p);
+  }
+  alignment.num_hits = kept;
+}
+
+bool LocalAlignment::clipHit(mm_reg1_t &r, int32_t start, int32_t end) {
+  if (r.rs >= end || r.re <= start)
+    return false;
+  uint32_t *cigar = r.p->cigar;
+  uint32_t first = 0, last = r.p->n_cigar; // ops kept, [first, last)
+  int32_t left = start - r.rs, right = r.re - end;
+  int32_t query_left = 0, query_right = 0;
+
+  // Ops are dropped from each end until the alignment starts within the
+  // bounds with an aligned base. A match across a bound is split.
+  auto clip = [&cigar](uint32_t i, int32_t &cut, int32_t &pos, int dir, int32_t &query) {
+    uint32_t op = cigar[i] & 0xf, len = cigar[i] >> 4;
+    bool on_ref = op == 0 || op == 2 || op == 3 || op == 7 || op == 8;
+    bool on_query = op == 0 || op == 1 || op == 7 || op == 8;
+    if (on_ref && on_query) {
+      if (cut <= 0)
+        return false;
+      if ((int32_t)len > cut) {
+        cigar[i] = (len - cut) << 4 | op;
+        pos += dir * cut;
+        query += cut;
+        cut = 0;
+        return false;
+      }
+    }
+    if (on_ref) {
+      pos += dir * (int32_t)len;
+      cut -= (int32_t)len;
+    }
+    if (on_query)
+      query += len;
+    return true;
+  };
+  while (first < last && clip(first, left, r.rs, 1, query_left))
+    first++;
+  while (last > first && clip(last - 1, right, r.re, -1, query_right))
+    last--;
+  if (first == last)
+    return false;
+
+  // the query runs backwards along the reference on the reverse strand
+  if (r.rev) {
+    r.qs += query_right;
+    r.qe -= query_left;
+  } else {
+    r.qs += query_left;
+    r.qe -= query_right;
+  }
+  memmove(cigar, cigar + first, (last - first) * sizeof(uint32_t));
+  r.p->n_cigar = last - first;
+  return true;
+}
+
+MinimapAlignment LocalAlignment::alignBanded(const std::string &seq) const {
+  MinimapAlignment alignment;
+  alignment.reg = NULL;
+  alignment.num_hits = 0;
+  BandedHit hit;
+  if (!m_banded_aligner->align(seq, m_params.min_chain_score, hit))
+    return alignment;
+
+  // freed like the hits of minimap2
+  mm_reg1_t *r = (mm_reg1_t *)calloc(1, sizeof(mm_reg1_t));
+  r->qs = hit.qs; r->qe = hit.qe;
+  r->rs = hit.ts; r->re = hit.te;
+  r->rev = hit.rev;
+  r->p = (mm_extra_t *)calloc(1, sizeof(mm_extra_t) + hit.cigar.size() * sizeof(uint32_t));
+  r->p->capacity = hit.cigar.size();
+  r->p->n_cigar = hit.cigar.size();
+  r->p->dp_score = r->p->dp_max = hit.score;
+  std::copy(hit.cigar.begin(), hit.cigar.end(), r->p->cigar);
+  alignment.reg = r;
+  alignment.num_hits = 1;
+  return alignment;
+}
+
+void LocalAlignment::align(const SeqLib::UnalignedSequenceVector &seqs, AlignmentContext &context) {
+  if (m_banded_aligner) {
+    for (auto &seq : seqs)
+      m_alignments[seq] = alignBanded(seq.Seq);
+    return;
+  }
+
+  mm_tbuf_t *thread_buf = context.buffer();
+  const mm_idx_t *index = m_reference_index ? m_reference_index->index() : m_minimap_index;
+  const mm_mapopt_t *map_opt = m_reference_index ? &m_reference_index->mapOpt() : &m_map_opt;
   for (auto &seq : seqs) {
     MinimapAlignment alignment;
     alignment.reg =
-        mm_map(m_minimap_index, seq.Seq.length(), seq.Seq.c_str(),
-               &alignment.num_hits, thread_buf, &m_map_opt, seq.Name.c_str());
+        mm_map(index, seq.Seq.length(), seq.Seq.c_str(),
+               &alignment.num_hits, thread_buf, map_opt, seq.Name.c_str());
+    if (m_reference_index)
+      keepTargetHits(alignment);
     m_alignments[seq] = alignment;
   }
-  mm_tbuf_destroy(thread_buf);
 }
 
 size_t LocalAlignment::writeAlignments(std::ostream &out) {
@@ -111,31 +261,19 @@ size_t LocalAlignment::writeAlignments(std::ostream &out) {
     SeqLib::UnalignedSequence seq = aln.first;
 
     for (int j = 0; j < num_hits; ++j) { // traverse hits and inspect them
-      // Query name, query length, query start, query end
-      std::stringstream query_record;
-      // Target name, target length, target start, target end
-      std::stringstream target_record;
-      // Data for the current hit
-      std::stringstream hit_record;
-
-      query_record << seq.Name.c_str() << " " << seq.Seq.length() << " ";
-
-      target_record << m_target_name << " " << m_minimap_index->seq->len << " ";
-
-      hit_record << j << " "
-                 << "+-"[reg->rev] << " ";
-
       mm_reg1_t *r = &reg[j];
       assert(r->p); // with MM_F_CIGAR, this should not be NULL
-      for (int i = 0; i < r->p->n_cigar; ++i)
-        hit_record << (r->p->cigar[i] >> 4) << ("MIDNSH"[r->p->cigar[i] & 0xf]);
 
-      query_record << (r->qs) << " " << (r->qe) << " ";
-      target_record << (r->rs) << " " << (r->re) << " ";
-
-      // put together the alignment summary
-      out << target_record.str() << query_record.str() << hit_record.str()
-          << std::endl;
+      // Target name, target length, target start, target end
+      out << m_target_name << " " << m_target_length << " "
+          << r->rs - m_target_start << " " << r->re - m_target_start << " ";
+      // Query name, query length, query start, query end
+      out << seq.Name << " " << seq.Seq.length() << " " << r->qs << " " << r->qe << " ";
+      // Data for the current hit
+      out << j << " " << "+-"[reg->rev] << " ";
+      for (uint32_t i = 0; i < r->p->n_cigar; ++i)
+        out << (r->p->cigar[i] >> 4) << ("MIDNSH"[r->p->cigar[i] & 0xf]);
+      out << "\n";
     }
   }
   return m_alignments.size();
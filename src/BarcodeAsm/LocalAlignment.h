@@ -4,15 +4,19 @@
 #include "SeqLib/BWAWrapper.h"
 #include "SeqLib/BamRecord.h"
 #include "SeqLib/GenomicRegion.h"
-#include "SeqLib/RefGenome.h"
 #include "SeqLib/UnalignedSequence.h"
 #include "minimap2/minimap.h"
 #include <cstring>
+#include <memory>
 #include <ostream>
 #include <stdlib.h>
 #include <unordered_map>
 #include <sstream>
 #include "AlignmentCommon.h"
+#include "AlignmentContext.h"
+#include "BandedAligner.h"
+#include "ReferenceGenome.h"
+#include "ReferenceIndex.h"
 
 struct LocalAlignmentParams {
   int max_join_long = 20000;
@@ -41,14 +45,27 @@ struct LocalAlignmentParams {
   int is_hpc = 1;
 };
 
+// How contigs are aligned to the reference of their window
+enum LocalAligner {
+  ALIGNER_MINIMAP2, // minimap2 with an index of the window
+  ALIGNER_BANDED    // ksw2 anchored at a shared k-mer, without an index
+};
+
 class LocalAlignment {
 public:
+  // The reference of the window is copied into the buffer of the context.
   LocalAlignment(std::string chr, size_t start, size_t end,
-                 const SeqLib::RefGenome &genome);
+                 const ReferenceGenome &genome, AlignmentContext &context,
+                 LocalAligner aligner = ALIGNER_MINIMAP2);
   LocalAlignment(std::string target_sequence, std::string target_name);
+  // Maps against a whole genome index instead, keeping the hits that overlap
+  // the window extended by flank bases, clipped to it. Coordinates are
+  // relative to the extended window.
+  LocalAlignment(std::string chr, size_t start, size_t end,
+                 const ReferenceIndex &index, size_t flank);
 
   ~LocalAlignment();
-  void align(const SeqLib::UnalignedSequenceVector &seqs);
+  void align(const SeqLib::UnalignedSequenceVector &seqs, AlignmentContext &context);
   size_t writeAlignments(std::ostream &out);
 
   // default minimap2 parameters
@@ -58,17 +75,33 @@ public:
            "CIGAR";
   }
 
+  // options tuned for large gaps, shared by all windows
+  static const mm_mapopt_t &tunedMapOpt();
+
 private:
-  void setupIndex(std::string target_sequence);
+  void setupIndex(const std::string &target_sequence);
+  static mm_mapopt_t makeMapOpt(const LocalAlignmentParams &params);
+  // Clips the hits of a whole genome index to its target, and drops the
+  // ones outside of it.
+  void keepTargetHits(MinimapAlignment &alignment) const;
+  // Clips a hit to the reference bases [start, end). Leading and trailing
+  // gaps are clipped with it. False if no aligned base is left.
+  static bool clipHit(mm_reg1_t &r, int32_t start, int32_t end);
+  // Aligns with the banded aligner, into the structures of minimap2 hits.
+  MinimapAlignment alignBanded(const std::string &seq) const;
 
-  mm_idx_t *m_minimap_index;
-  mm_idxopt_t m_index_opt;
+  mm_idx_t *m_minimap_index;  // NULL with a whole genome index or ALIGNER_BANDED
+  std::unique_ptr<BandedAligner> m_banded_aligner;
   mm_mapopt_t m_map_opt;
 
-  char *m_local_sequence;
-
   std::string m_target_name;
 
+  const ReferenceIndex *m_reference_index;
+  int m_target_rid;
+  size_t m_target_start;
+  size_t m_target_end;        // inclusive
+  size_t m_target_length;
+
   std::unordered_map<SeqLib::UnalignedSequence, MinimapAlignment,
                      UnalignedSequenceHash, UnalignedSequenceEqualsTo>
       m_alignments;
@@ -1,7 +1,8 @@
 #include "LocalAssemblyWindow.h"
+#include "Hashing.h"
 
 LocalAssemblyWindow::LocalAssemblyWindow(SeqLib::GenomicRegion region,
-                                         SeqLib::BamReader bam,
+                                         HtsBamReader bam,
                                          BxBamWalker bx_bam,
                                          AssemblyParams params)
     : m_params(params), m_region(region), m_bam(bam), m_bx_bam(bx_bam) {
@@ -13,97 +14,159 @@ LocalAssemblyWindow::LocalAssemblyWindow(SeqLib::GenomicRegion region,
   m_fml_opt.max_cnt = m_params.max_cnt;
   m_fml_opt.min_asm_ovlp = m_params.min_asm_ovlp;
   m_fml_opt.ec_k = m_params.ec_k;
+  m_fml_opt.n_threads = m_params.fermi_threads;
 
-  std::stringstream prefix_ss;
-  prefix_ss << region.ChrName(bam.Header()) << "_" << region.pos1 << "_"
-            << region.pos2;
-  m_prefix = prefix_ss.str();
+  m_prefix = windowPrefix(region, bam.Header());
 
 }
 
-size_t LocalAssemblyWindow::retrieveGenomewideReads() {
-  collectLocalBarcodes();
-  std::cerr << "Pre barcode collection: " << m_reads.size() << std::endl;
+std::vector<BxBarcodeId> LocalAssemblyWindow::getBarcodes() const {
+  std::vector<BxBarcodeId> barcodes;
+  barcodes.reserve(m_barcodes.size());
+  m_barcodes.forEach([&barcodes](BxBarcodeId id, const BxBarcodeInfo &) {
+      barcodes.push_back(id);
+  });
+  return barcodes;
+}
 
-  // Barcode frequency in assembly window
-  // std::cerr << "Barcode frequency" <<  std::endl;
-  size_t total = 0;
-  for (const auto &b : m_barcode_count) {
-    // std::cerr << b.first << " " << b.second << std::endl;
-    total += b.second;
+size_t LocalAssemblyWindow::addGenomewideReads(const BamReadVector &genomewide_reads) {
+  {
+    StageTimer timer(m_stats, STAGE_DEDUP);
+    for(auto &r : genomewide_reads)
+        addGenomewideRead(r.raw(), m_bx_bam.barcodeIdOf(r));
   }
+  std::cerr << "Post barcode collection: " << m_reads.size() << std::endl;
+  reportDuplicates();
+  return m_reads.size();
+}
+
+void LocalAssemblyWindow::reportBarcodes() const {
+  // Barcode frequency in assembly window
+  size_t total = 0, phase_sets = 0, phased = 0;
+  m_barcodes.forEach([&](BxBarcodeId, const BxBarcodeInfo &b) {
+    total += b.count;
+    phase_sets += b.has_phase_set;
+    phased += b.has_hap;
+  });
   std::cerr << "Total reads " << total << std::endl;
-  std::cerr << "Total barcodes " << m_barcode_count.size() << std::endl;
+  std::cerr << "Total barcodes " << m_barcodes.size() << std::endl;
+  std::cerr << "Total phase sets " << phase_sets << std::endl;
+  std::cerr << "Phased barcodes " << phased << std::endl;
+}
 
-  std::cerr << "Barcode phase sets" << std::endl;
-  for (const auto &b : m_barcode_phase) {
-    // std::cerr << b.first << " " << b.second << std::endl;
-    total += b.second;
-  }
-  std::cerr << "Total phase sets " << m_barcode_phase.size() << std::endl;
+void LocalAssemblyWindow::addGenomewideRead(const bam1_t *b, BxBarcodeId barcode) {
+  // make sure to only import unique reads, on either strand
+  m_stats.genomewide_reads++;
+  m_stats.bytes_read += sizeof(bam1_core_t) + b->l_data;
+  if(m_fingerprints.insert(fingerprintRead(b)))
+      m_reads.append(b, barcode);
+  else
+      m_stats.duplicate_reads++;
+}
 
-  std::cerr << "Barcode haplotype" << std::endl;
-  for (const auto &b : m_barcode_hap) {
-    // std::cerr << b.first << " " << b.second << std::endl;
-    total += b.second;
-  }
-  std::cerr << "Phased barcodes " << m_barcode_hap.size() << std::endl;
-
-  // make sure to only import unique reads
-  // tally already imported reads
-  std::unordered_set<std::string> seqs;
-  for(auto& r : m_reads)
-      seqs.insert(r.Sequence());
-  // add the genome wide reads to assembly
-  std::vector<BxBarcode> barcodes;
-  for (auto &b : m_barcode_count)
-      barcodes.push_back(b.first);
-
-  BamReadVector genomewide_reads = m_bx_bam.fetchReadsByBxBarcode(barcodes);
-  for(auto &r : genomewide_reads) {
-      // add this record if it is new
-      if(seqs.count(r.Sequence()) == 0) {
-          seqs.insert(r.Sequence());
-          m_reads.push_back(r);
-      }
+void LocalAssemblyWindow::reportDuplicates() const {
+  double rate = m_stats.genomewide_reads == 0 ? 0.0 :
+      100.0 * m_stats.duplicate_reads / m_stats.genomewide_reads;
+  std::cerr << "Duplicate reads " << m_stats.duplicate_reads << " of " << m_stats.genomewide_reads
+            << " (" << rate << "%)" << std::endl;
+}
+
+WindowStats &LocalAssemblyWindow::getStats() { return m_stats; }
+
+size_t LocalAssemblyWindow::filterReadsByKmers(const std::string &reference) {
+  StageTimer timer(m_stats, STAGE_KMER_FILTER);
+  // local reads are always the first reads of the window
+  uint32_t local_reads = m_stats.local_reads;
+  KmerRelevanceFilter filter(m_params.kmer_size, m_params.kmer_min_shared, m_params.kmer_rounds);
+  if (!reference.empty())
+      filter.addSequence(reference);
+  std::vector<bool> keep = filter.select(m_reads, local_reads);
+
+  size_t candidates = m_reads.size() - local_reads;
+  size_t kept = std::count(keep.begin() + local_reads, keep.end(), true);
+  m_reads.retain(keep);
+  m_stats.kmer_filtered_reads = candidates - kept;
+  std::cerr << "Kmer filter kept " << kept << " of " << candidates
+            << " genome wide reads in " << filter.roundsRun() << " rounds ("
+            << filter.kmers() << " kmers)" << std::endl;
+  return m_reads.size();
+}
+
+size_t LocalAssemblyWindow::estimateAssemblyBytes() const {
+  return m_reads.bytes() + m_reads.bases() * ASSEMBLY_BYTES_PER_BASE;
+}
+
+size_t LocalAssemblyWindow::estimateAssemblyBytes(uint64_t genomewide_reads) const {
+  if (m_reads.size() == 0)
+    return 0;
+  return estimateAssemblyBytes() / m_reads.size() * (m_reads.size() + genomewide_reads);
+}
+
+size_t LocalAssemblyWindow::downsampleGenomewideReads(double fraction) {
+  uint32_t local_reads = m_stats.local_reads;
+  std::vector<bool> keep(m_reads.size(), true);
+  size_t dropped = 0;
+  for (uint32_t i = local_reads; i < m_reads.size(); i++) {
+      // hash of the name, so that the choice is the same for both mates
+      uint64_t h = fnv1a(m_reads.name(i));
+      keep[i] = (h >> 11) * (1.0 / 9007199254740992.0) < fraction;
+      dropped += !keep[i];
   }
-  std::cerr << "Post barcode collection: " << m_reads.size() << std::endl;
+  m_reads.retain(keep);
+  m_stats.downsampled_reads += dropped;
+  std::cerr << "Downsampled " << dropped << " genome wide reads to fit the memory budget" << std::endl;
   return m_reads.size();
 }
 
 size_t LocalAssemblyWindow::assembleReads() {
-  retrieveGenomewideReads();
-
+  StageTimer timer(m_stats, STAGE_ASSEMBLY);
+  m_stats.reads = m_reads.size();
   // Use the phased reads to do haploid assembly of the region
   if(m_params.split_reads_by_phase) {
       PhaseSplit split = separateReadsByPhase();
 
-      BamReadVector &first_phase = std::get<0>(split);
+      ReadIds &first_phase = std::get<0>(split);
       int &first_phase_set = std::get<1>(split);
-      BamReadVector &second_phase = std::get<2>(split);
+      ReadIds &second_phase = std::get<2>(split);
       int &second_phase_set = std::get<3>(split);
 
       std::cerr << "Phase 1 reads " << first_phase.size() << " in read set " << first_phase_set << std::endl;
       std::cerr << "Phase 2 reads " << second_phase.size() << " in read set " << second_phase_set << std::endl;
 
-      size_t h1 = assemblePhase(first_phase, "1", first_phase_set);
-      size_t h2 = assemblePhase(second_phase, "2", second_phase_set);
-      return h1 + h2;
+      // The second phase is assembled on its own thread while this one does
+      // the first. Its contigs still come after those of the first phase.
+      SeqLib::UnalignedSequenceVector second_contigs;
+      std::future<size_t> h2 = std::async(std::launch::async, [&]() {
+          return assemblePhase(second_phase, "2", second_phase_set, second_contigs);
+      });
+      size_t h1 = assemblePhase(first_phase, "1", first_phase_set, m_contigs);
+      size_t count = h1 + h2.get();
+      m_contigs.insert(m_contigs.end(), second_contigs.begin(), second_contigs.end());
+      m_stats.contigs = m_contigs.size();
+      return count;
   }
   // Assemble the diploid assembly of the region
   else {
-      return assemblePhase(m_reads, "0", 0);
+      ReadIds all_reads(m_reads.size());
+      for(uint32_t i = 0; i < all_reads.size(); i++)
+          all_reads[i] = i;
+      size_t count = assemblePhase(all_reads, "0", 0, m_contigs);
+      m_stats.contigs = m_contigs.size();
+      return count;
   }
 }
 
-size_t LocalAssemblyWindow::assemblePhase(BamReadVector &phased_reads, std::string phase, int phase_set) {
+size_t LocalAssemblyWindow::assemblePhase(const ReadIds &phased_reads, std::string phase, int phase_set,
+                                          SeqLib::UnalignedSequenceVector &contigs) const {
   SeqLib::FermiAssembler fermi(m_fml_opt);
 
   // don't attempt empty assembly
   if(phased_reads.size() < 2)
 	  return 0;
   fermi.SetMinOverlap(m_params.min_overlap);
-  fermi.AddReads(phased_reads);
+  // fermi copies the reads, so they are only decoded one at a time
+  for(uint32_t i : phased_reads)
+      fermi.AddRead(m_reads.unaligned(i));
   // heterozygous bubble popping
   if (m_params.aggressive_bubble_pop)
       fermi.SetAggressiveTrim();
@@ -129,7 +192,7 @@ size_t LocalAssemblyWindow::assemblePhase(BamReadVector &phased_reads, std::stri
   for (auto contig : fermi.GetContigs()) {
     std::stringstream ss;
     ss << phase_prefix << "_" << count;
-    m_contigs.push_back(SeqLib::UnalignedSequence(ss.str(), contig));
+    contigs.push_back(SeqLib::UnalignedSequence(ss.str(), contig));
     ++count;
   }
   return count;
@@ -138,49 +201,64 @@ size_t LocalAssemblyWindow::assemblePhase(BamReadVector &phased_reads, std::stri
 
 void LocalAssemblyWindow::collectLocalBarcodes() {
   std::cerr << m_region.ToString(m_bam.Header()) << std::endl;
+  StageTimer timer(m_stats, STAGE_LOCAL_FETCH);
   m_bam.SetRegion(m_region);
 
-  while (true) {
-    // Retrieve all reads within this region and their barcode frequencies and
-    // phase sets
-    SeqLib::BamRecord bam_record;
-
-    if (m_bam.GetNextRecord(bam_record)) {
-      m_reads.push_back(bam_record);
-
-      // collect barcode and its phase set
-      std::string bx_tag;
-      // barcode tag may not always be present
-      if (bam_record.GetZTag("BX", bx_tag)) {
-          if (m_barcode_count.find(bx_tag) == m_barcode_count.end()) {
-
-              // barcode init
-              m_barcode_count[bx_tag] = 1;
-              fillPhasingData(bam_record, bx_tag);
-          }
-          else {
-              m_barcode_count[bx_tag] = m_barcode_count[bx_tag] + 1;
-              fillPhasingData(bam_record, bx_tag);
-          }
-      }
-    } else
-      break;
+  // Retrieve all reads within this region and their barcode frequencies and
+  // phase sets. The record is only read into, the store keeps its own copy.
+  bam1_t *b = bam_init1();
+  while (m_bam.GetNextRecord(b))
+    addLocalRead(b);
+  bam_destroy1(b);
+}
+
+void LocalAssemblyWindow::addLocalRead(const bam1_t *b) {
+  // collect barcode and its phase set
+  uint8_t *bx = bam_aux_get(b, "BX");
+  const char *bx_tag = bx == NULL ? NULL : bam_aux2Z(bx);
+  BxBarcodeId bx_id = 0;
+  // barcode tag may not always be present
+  if (bx_tag != NULL && bx_tag[0] != '\0') {
+      bx_id = packBarcode(bx_tag, strlen(bx_tag));
+      // barcode init on first sight
+      BxBarcodeInfo &barcode = m_barcodes[bx_id];
+      barcode.count++;
+      fillPhasingData(b, barcode);
   }
+  m_reads.append(b, bx_id);
+  // local reads are all kept, but genome wide copies of them are not
+  m_fingerprints.insert(fingerprintRead(b));
+  m_stats.bytes_read += sizeof(bam1_core_t) + b->l_data;
+  m_stats.local_reads = m_reads.size();
+  m_stats.barcodes = m_barcodes.size();
+}
+
+bool LocalAssemblyWindow::overlaps(const bam1_t *b) const {
+  // same test as the htslib region iterator
+  return b->core.tid == m_region.chr && b->core.pos < m_region.pos2 &&
+         bam_endpos(b) > m_region.pos1;
+}
+
+bool LocalAssemblyWindow::hasBarcode(BxBarcodeId id) const {
+  return m_barcodes.find(id) != NULL;
 }
 
-void LocalAssemblyWindow::fillPhasingData(SeqLib::BamRecord &bam_record, std::string &bx_tag) {
+void LocalAssemblyWindow::fillPhasingData(const bam1_t *b, BxBarcodeInfo &barcode) {
   // Do nothing if already filled
-  if(m_barcode_hap.count(bx_tag) == 1)
+  if(barcode.has_hap)
     return;
   // barcode phase set init
-  int ps;
-  if (bam_record.GetIntTag("PS", ps)) {
-    m_barcode_phase[bx_tag] = ps;
+  uint8_t *ps = bam_aux_get(b, "PS");
+  if (ps != NULL) {
+    barcode.phase_set = bam_aux2i(ps);
+    barcode.has_phase_set = true;
 
     // barcode haplotype init
-    int hp;
-    if (bam_record.GetIntTag("HP", hp))
-      m_barcode_hap[bx_tag] = hp;
+    uint8_t *hp = bam_aux_get(b, "HP");
+    if (hp != NULL) {
+      barcode.hap = bam_aux2i(hp);
+      barcode.has_hap = true;
+    }
   }
 }
 
@@ -188,7 +266,7 @@ SeqLib::UnalignedSequenceVector LocalAssemblyWindow::getContigs() const {
   return m_contigs;
 }
 
-BamReadVector LocalAssemblyWindow::getReads() const { return m_reads; }
+const ReadStore &LocalAssemblyWindow::getReads() const { return m_reads; }
 
 void LocalAssemblyWindow::sortContigs() {
     // sort contigs in decreasing sequence length order
@@ -200,34 +278,33 @@ void LocalAssemblyWindow::sortContigs() {
 
 PhaseSplit LocalAssemblyWindow::separateReadsByPhase() {
     PhaseSplit phase_split;
-    BamReadVector &first_phase = std::get<0>(phase_split);
+    ReadIds &first_phase = std::get<0>(phase_split);
     int &first_phase_set = std::get<1>(phase_split);
-    BamReadVector &second_phase = std::get<2>(phase_split);
+    ReadIds &second_phase = std::get<2>(phase_split);
     int &second_phase_set = std::get<3>(phase_split);
 
     // run through the reads and split according to barcode/phase association
-    for(auto &r : m_reads) {
-        std::string bx_tag;
-        if(r.GetZTag("BX", bx_tag)) {
-            // check if we have a phasing for this barcode
-            if(m_barcode_hap.count(bx_tag) == 0) {
-                // std::cerr << "Unphased barcode " << bx_tag << std::endl;
-                // add read to both phases if read is unphased
-                first_phase.push_back(r);
-                second_phase.push_back(r);
-                continue;
-            }
-            // inspect the haplotype tag for the phase, and assign phase sets
-            switch(m_barcode_hap[bx_tag]) {
-            case 1:
-                first_phase.push_back(r);
-                first_phase_set = m_barcode_phase[bx_tag];
-                break;
-            case 2:
-                second_phase.push_back(r);
-                second_phase_set = m_barcode_phase[bx_tag];
-                break;
-            }
+    for(uint32_t r = 0; r < m_reads.size(); r++) {
+        if(m_reads.barcode(r) == 0)
+            continue;
+        // check if we have a phasing for this barcode
+        const BxBarcodeInfo *barcode = m_barcodes.find(m_reads.barcode(r));
+        if(barcode == NULL || !barcode->has_hap) {
+            // add read to both phases if read is unphased
+            first_phase.push_back(r);
+            second_phase.push_back(r);
+            continue;
+        }
+        // inspect the haplotype tag for the phase, and assign phase sets
+        switch(barcode->hap) {
+        case 1:
+            first_phase.push_back(r);
+            first_phase_set = barcode->phase_set;
+            break;
+        case 2:
+            second_phase.push_back(r);
+            second_phase_set = barcode->phase_set;
+            break;
         }
     }
     return phase_split;
@@ -236,6 +313,7 @@ PhaseSplit LocalAssemblyWindow::separateReadsByPhase() {
 
 void LocalAssemblyWindow::clearReads() {
     m_reads.clear();
+    m_fingerprints.clear();
 }
 
 void LocalAssemblyWindow::writeContigs(std::ostream &out) {
@@ -245,6 +323,14 @@ void LocalAssemblyWindow::writeContigs(std::ostream &out) {
     }
 }
 
+std::string LocalAssemblyWindow::windowPrefix(const SeqLib::GenomicRegion &region,
+                                              const SeqLib::BamHeader &header) {
+  std::stringstream prefix_ss;
+  prefix_ss << region.ChrName(header) << "_" << region.pos1 << "_"
+            << region.pos2;
+  return prefix_ss.str();
+}
+
 std::string LocalAssemblyWindow::getPrefix() const {
     return m_prefix;
 }
@@ -2,7 +2,11 @@
 #define LOCAL_ASSEMBLY_WINDOW_H
 
 #include "BxBamWalker.h"
-#include "SeqLib/BamReader.h"
+#include "HtsBamReader.h"
+#include "KmerFilter.h"
+#include "ReadFingerprint.h"
+#include "ReadStore.h"
+#include "WindowStats.h"
 #include "SeqLib/BamRecord.h"
 #include "SeqLib/FermiAssembler.h"
 #include "SeqLib/GenomicRegion.h"
@@ -11,6 +15,7 @@
 #include "fermi-lite/fml.h"
 #include <algorithm>
 #include <fstream>
+#include <future>
 #include <iterator>
 #include <ostream>
 #include <sstream>
@@ -30,43 +35,89 @@ struct AssemblyParams {
     int max_cnt = 40;
     int min_asm_ovlp = 33;
     int ec_k = 0;
+    // threads of each fermi-lite assembly, on top of the two phase threads
+    int fermi_threads = 1;
+    // keep only the genome wide reads sharing k-mers with the local reads
+    bool kmer_filter = false;
+    bool kmer_filter_reference = false;
+    int kmer_size = 25;
+    int kmer_min_shared = 2;
+    int kmer_rounds = 2;
 };
 
-typedef std::unordered_map<BxBarcode, int> BxBarcodeCounts;
-typedef std::unordered_map<BxBarcode, int> BxBarcodePS;
-typedef std::unordered_map<BxBarcode, int> BxBarcodeHap;
 // first phase reads, first phase set ID, second phase reads, second phase set ID
-typedef std::tuple<BamReadVector, int, BamReadVector, int> PhaseSplit;
+typedef std::tuple<ReadIds, int, ReadIds, int> PhaseSplit;
 
 class LocalAssemblyWindow {
 public:
-    LocalAssemblyWindow(SeqLib::GenomicRegion region, SeqLib::BamReader bam, BxBamWalker bx_bam, AssemblyParams params);
-    size_t retrieveGenomewideReads();
+    LocalAssemblyWindow(SeqLib::GenomicRegion region, HtsBamReader bam, BxBamWalker bx_bam, AssemblyParams params);
+    // Assembles the reads collected by a WindowGroup, or by
+    // collectLocalBarcodes and addGenomewideReads.
     size_t assembleReads();
     void collectLocalBarcodes();
+    std::vector<BxBarcodeId> getBarcodes() const;
+    size_t addGenomewideReads(const BamReadVector &genomewide_reads);
+    // Drops the genome wide reads without enough k-mers in common with the
+    // local reads, and the reference of the window if it is not empty.
+    size_t filterReadsByKmers(const std::string &reference);
+    // Rough memory footprint of assembling the reads of the window.
+    size_t estimateAssemblyBytes() const;
+    // Same, once this many genome wide reads like the local ones are added.
+    size_t estimateAssemblyBytes(uint64_t genomewide_reads) const;
+    // Keeps about this fraction of the genome wide reads, and all the local
+    // reads. Mates are kept or dropped together.
+    size_t downsampleGenomewideReads(double fraction);
+
+    // Read by read versions of the above, for callers that fetch the reads
+    // of several windows at once (see WindowGroup).
+    // True if the read would be returned by a fetch of the window region.
+    bool overlaps(const bam1_t *b) const;
+    void addLocalRead(const bam1_t *b);
+    bool hasBarcode(BxBarcodeId id) const;
+    // Adds the read unless its sequence, or its reverse complement, is
+    // already in the window.
+    void addGenomewideRead(const bam1_t *b, BxBarcodeId barcode);
+    void reportBarcodes() const;
+    void reportDuplicates() const;
+
     SeqLib::UnalignedSequenceVector getContigs() const;
-    BamReadVector getReads() const;
+    const ReadStore &getReads() const;
     void clearReads();
     void writeContigs(std::ostream &out);
     std::string getPrefix() const;
+    // chr_start_end, the prefix of the contig names of a window
+    static std::string windowPrefix(const SeqLib::GenomicRegion &region,
+                                    const SeqLib::BamHeader &header);
+    // Stages of the window record their times and counts here. Callers add
+    // the stages that run outside of the window.
+    WindowStats &getStats();
 
   private:
     void sortContigs();
-    size_t assemblePhase(BamReadVector &phased_reads, std::string phase, int phase_set);
+    // Appends the contigs of one phase to contigs. Phases can be assembled
+    // concurrently, since only the read store is shared, read only.
+    size_t assemblePhase(const ReadIds &phased_reads, std::string phase, int phase_set,
+                         SeqLib::UnalignedSequenceVector &contigs) const;
     PhaseSplit separateReadsByPhase();
-    void fillPhasingData(SeqLib::BamRecord &bam_record, std::string &bx_tag);
+    void fillPhasingData(const bam1_t *b, BxBarcodeInfo &barcode);
+
+    // fermi-lite memory per read base: its copy of the reads, the FM-index
+    // and the unitig graph
+    static const size_t ASSEMBLY_BYTES_PER_BASE = 16;
 
     AssemblyParams m_params;
     SeqLib::GenomicRegion m_region;
-    SeqLib::BamReader m_bam;
+    HtsBamReader m_bam;
     BxBamWalker m_bx_bam;
-    BamReadVector m_reads;
+    // reads of the window, with their barcode (0 if they have none)
+    ReadStore m_reads;
+    // fingerprints of the sequences in m_reads
+    ReadFingerprintSet m_fingerprints;
+    WindowStats m_stats;
     std::string m_prefix;
     SeqLib::UnalignedSequenceVector m_contigs;
     // keep track of barcode frequency and their phase set
-    BxBarcodeCounts m_barcode_count;
-    BxBarcodePS m_barcode_phase;
-    BxBarcodeHap m_barcode_hap;
+    BxBarcodeTable m_barcodes;
     // assembly parameters
     fml_opt_t m_fml_opt;
 };
@@ -0,0 +1,63 @@
+#include "MemoryBudget.h"
+#include <algorithm>
+
+MemoryBudget::MemoryBudget(size_t limit) : m_limit(limit), m_used(0), m_next_ticket(0), m_serving(0) {}
+
+size_t MemoryBudget::limit() const { return m_limit; }
+
+size_t MemoryBudget::reserve(size_t bytes) {
+  bytes = std::min(bytes, m_limit);
+  std::unique_lock<std::mutex> lock(m_mutex);
+  uint64_t ticket = m_next_ticket++;
+  m_released.wait(lock, [this, ticket, bytes] {
+    return ticket == m_serving && m_used + bytes <= m_limit;
+  });
+  m_serving++;
+  m_used += bytes;
+  lock.unlock();
+  // the next ticket may fit as well
+  m_released.notify_all();
+  return bytes;
+}
+
+void MemoryBudget::grow(size_t bytes) {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  m_used += bytes;
+}
+
+void MemoryBudget::release(size_t bytes) {
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_used -= bytes;
+  }
+  m_released.notify_all();
+}
+
+MemoryReservation::MemoryReservation(MemoryBudget *budget, size_t bytes)
+    : m_budget(budget), m_bytes(0) {
+  if (m_budget)
+    m_bytes = m_budget->reserve(bytes);
+}
+
+MemoryReservation::~MemoryReservation() {
+  if (m_budget)
+    m_budget->release(m_bytes);
+}
+
+size_t MemoryReservation::bytes() const { return m_bytes; }
+
+void MemoryReservation::resize(size_t bytes) {
+  if (!m_budget)
+    return;
+  bytes = std::min(bytes, m_budget->limit());
+  if (m_bytes == 0) {
+    if (bytes > 0)
+      m_bytes = m_budget->reserve(bytes);
+  } else if (bytes > m_bytes) {
+    m_budget->grow(bytes - m_bytes);
+    m_bytes = bytes;
+  } else if (bytes < m_bytes) {
+    m_budget->release(m_bytes - bytes);
+    m_bytes = bytes;
+  }
+}
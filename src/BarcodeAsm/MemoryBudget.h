@@ -0,0 +1,59 @@
+#ifndef MEMORY_BUDGET_H
+#define MEMORY_BUDGET_H
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+
+class MemoryBudget {
+    /* Process wide budget for the memory of the windows being assembled.
+       Workers reserve the estimated footprint of a window before assembling
+       it, and wait while the other windows hold too much of the budget. A
+       reservation larger than the whole budget is clamped to it, and only
+       waits for the budget to be completely free, so it cannot wait forever.
+       Reservations are served in the order they were asked for, so a large
+       one is not overtaken by a stream of small ones.
+    */
+
+public:
+    MemoryBudget(size_t limit);
+
+    size_t limit() const;
+    // Blocks until the bytes fit, returns the bytes actually reserved.
+    size_t reserve(size_t bytes);
+    // Adds to a reservation without waiting, for memory already in use.
+    void grow(size_t bytes);
+    void release(size_t bytes);
+
+private:
+    size_t m_limit;
+    size_t m_used;
+    // next ticket to hand out, and ticket of the reservation being served
+    uint64_t m_next_ticket;
+    uint64_t m_serving;
+    std::mutex m_mutex;
+    std::condition_variable m_released;
+};
+
+class MemoryReservation {
+    /* Releases a reservation when going out of scope */
+
+public:
+    MemoryReservation(MemoryBudget *budget, size_t bytes);
+    ~MemoryReservation();
+    MemoryReservation(const MemoryReservation &) = delete;
+    MemoryReservation &operator=(const MemoryReservation &) = delete;
+
+    size_t bytes() const;
+    /* Sets the reservation to this many bytes. An empty reservation waits
+       for them like a new one; a held one grows without waiting, since its
+       memory is already in use. */
+    void resize(size_t bytes);
+
+private:
+    MemoryBudget *m_budget;
+    size_t m_bytes;
+};
+
+#endif
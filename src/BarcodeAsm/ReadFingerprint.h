@@ -0,0 +1,108 @@
+#ifndef READ_FINGERPRINT_H
+#define READ_FINGERPRINT_H
+
+#include "Hashing.h"
+#include "htslib/sam.h"
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/* 128 bit fingerprint of a read sequence, equal for a read and its reverse
+   complement. Two polynomial hashes with different bases are rolled over the
+   2-bit base codes, once forward and once over the reverse complement, and
+   the smaller of the two results is kept. Ambiguous bases hash as a fifth
+   symbol. (0, 0) is never a valid fingerprint.
+*/
+struct ReadFingerprint {
+  uint64_t hi = 0;
+  uint64_t lo = 0;
+
+  bool operator==(const ReadFingerprint &o) const { return hi == o.hi && lo == o.lo; }
+  bool operator<(const ReadFingerprint &o) const {
+    return hi < o.hi || (hi == o.hi && lo < o.lo);
+  }
+};
+
+// 2-bit code of the 4-bit BAM base codes, 4 for anything but A, C, G or T
+static const uint8_t BAM_BASE_TO_2BIT[16] = {4, 0, 1, 4, 2, 4, 4, 4, 3, 4, 4, 4, 4, 4, 4, 4};
+
+inline ReadFingerprint fingerprintRead(const bam1_t *b) {
+  const uint64_t B1 = 0x9e3779b97f4a7c15ULL, B2 = 0xc2b2ae3d27d4eb4fULL;
+  const uint8_t *seq = bam_get_seq(b);
+  int len = b->core.l_qseq;
+
+  // Symbols are 1-5, so that leading A's still change the hash. The reverse
+  // complement is rolled from the last base, complementing 0-3 as 3 - code.
+  uint64_t f1 = 0, f2 = 0, r1 = 0, r2 = 0;
+  for (int j = 0; j < len; j++) {
+    uint64_t fc = BAM_BASE_TO_2BIT[bam_seqi(seq, j)];
+    uint64_t rc = BAM_BASE_TO_2BIT[bam_seqi(seq, len - 1 - j)];
+    rc = rc > 3 ? rc : 3 - rc;
+    f1 = f1 * B1 + fc + 1;
+    f2 = f2 * B2 + fc + 1;
+    r1 = r1 * B1 + rc + 1;
+    r2 = r2 * B2 + rc + 1;
+  }
+
+  ReadFingerprint fwd, rev;
+  fwd.hi = mix64(f1 ^ (uint64_t)len);
+  fwd.lo = mix64(f2 + (uint64_t)len);
+  rev.hi = mix64(r1 ^ (uint64_t)len);
+  rev.lo = mix64(r2 + (uint64_t)len);
+  ReadFingerprint canonical = rev < fwd ? rev : fwd;
+  if (canonical.hi == 0 && canonical.lo == 0)
+    canonical.lo = 1;
+  return canonical;
+}
+
+class ReadFingerprintSet {
+  /* Flat open addressing set of fingerprints, with linear probing over a
+     power of two capacity. */
+
+public:
+  ReadFingerprintSet() : m_size(0) { m_slots.resize(1024); }
+
+  // Returns false if the fingerprint was already in the set.
+  bool insert(const ReadFingerprint &f) {
+    if ((m_size + 1) * 4 > m_slots.size() * 3)
+      grow();
+    ReadFingerprint &slot = m_slots[probe(f)];
+    if (!empty(slot))
+      return false;
+    slot = f;
+    m_size++;
+    return true;
+  }
+
+  size_t size() const { return m_size; }
+
+  void clear() {
+    std::vector<ReadFingerprint>(1024).swap(m_slots);
+    m_size = 0;
+  }
+
+private:
+  static bool empty(const ReadFingerprint &f) { return f.hi == 0 && f.lo == 0; }
+
+  size_t probe(const ReadFingerprint &f) const {
+    // the fingerprint is already well mixed
+    size_t mask = m_slots.size() - 1;
+    size_t i = f.lo & mask;
+    while (!empty(m_slots[i]) && !(m_slots[i] == f))
+      i = (i + 1) & mask;
+    return i;
+  }
+
+  void grow() {
+    std::vector<ReadFingerprint> old(m_slots.size() * 2);
+    old.swap(m_slots);
+    for (const ReadFingerprint &f : old)
+      if (!empty(f))
+        m_slots[probe(f)] = f;
+  }
+
+  std::vector<ReadFingerprint> m_slots;
+  size_t m_size;
+};
+
+#endif
@@ -0,0 +1,152 @@
+#include "ReadStore.h"
+
+namespace {
+const char BASES[4] = {'A', 'C', 'G', 'T'};
+}
+
+ReadStore::ReadStore() : m_first_ambiguous(1, 0) {}
+
+uint32_t ReadStore::append(const bam1_t *b, BxBarcodeId barcode) {
+  uint32_t id = m_lengths.size();
+  uint64_t offset = m_qualities.size();
+  uint32_t len = b->core.l_qseq;
+
+  m_offsets.push_back(offset);
+  m_lengths.push_back(len);
+  m_names.push_back(internName(bam_get_qname(b)));
+  m_barcodes.push_back(barcode);
+
+  // bases are packed from the low bits up, across read boundaries
+  const uint8_t *seq = bam_get_seq(b);
+  m_bases.resize((offset + len + 3) / 4, 0);
+  for (uint32_t j = 0; j < len; j++) {
+    uint8_t code = BAM_BASE_TO_2BIT[bam_seqi(seq, j)];
+    if (code > 3) {
+      m_ambiguous.push_back(j);
+      code = 0;
+    }
+    setBaseCode(offset + j, code);
+  }
+  m_first_ambiguous.push_back(m_ambiguous.size());
+
+  // keep the arenas aligned even without qualities
+  const uint8_t *qual = bam_get_qual(b);
+  bool has_quality = len > 0 && qual[0] != 0xff;
+  m_has_quality.push_back(has_quality);
+  m_qualities.resize(offset + len, '!');
+  if (has_quality)
+    for (uint32_t j = 0; j < len; j++)
+      m_qualities[offset + j] = qual[j] + 33;
+  return id;
+}
+
+uint32_t ReadStore::internName(const char *name) {
+  auto it = m_name_ids.find(name);
+  if (it != m_name_ids.end())
+    return it->second;
+  uint32_t id = m_name_offsets.size();
+  m_name_offsets.push_back(m_name_pool.size());
+  m_name_pool.insert(m_name_pool.end(), name, name + strlen(name) + 1);
+  m_name_ids.emplace(name, id);
+  return id;
+}
+
+size_t ReadStore::size() const { return m_lengths.size(); }
+
+bool ReadStore::empty() const { return m_lengths.empty(); }
+
+void ReadStore::clear() {
+  // replace with empty containers to give the memory back
+  *this = ReadStore();
+}
+
+size_t ReadStore::bytes() const {
+  size_t b = m_offsets.capacity() * sizeof(uint64_t) +
+             m_lengths.capacity() * sizeof(uint32_t) +
+             m_names.capacity() * sizeof(uint32_t) +
+             m_barcodes.capacity() * sizeof(BxBarcodeId) +
+             m_first_ambiguous.capacity() * sizeof(uint32_t) +
+             m_has_quality.capacity() / 8 + m_bases.capacity() +
+             m_qualities.capacity() + m_ambiguous.capacity() * sizeof(uint32_t) +
+             m_name_pool.capacity() + m_name_offsets.capacity() * sizeof(uint32_t);
+  // the name map holds a second copy of each name, plus a node
+  return b + m_name_pool.size() + m_name_ids.size() * 4 * sizeof(void *);
+}
+
+uint64_t ReadStore::bases() const { return m_qualities.size(); }
+
+const char *ReadStore::name(uint32_t i) const {
+  return &m_name_pool[m_name_offsets[m_names[i]]];
+}
+
+uint32_t ReadStore::nameId(uint32_t i) const { return m_names[i]; }
+
+size_t ReadStore::nameCount() const { return m_name_offsets.size(); }
+
+uint32_t ReadStore::length(uint32_t i) const { return m_lengths[i]; }
+
+BxBarcodeId ReadStore::barcode(uint32_t i) const { return m_barcodes[i]; }
+
+void ReadStore::sequence(uint32_t i, std::string &out) const {
+  uint64_t offset = m_offsets[i];
+  uint32_t len = m_lengths[i];
+  out.resize(len);
+  for (uint32_t j = 0; j < len; j++)
+    out[j] = BASES[baseCode(offset + j)];
+  for (uint32_t a = m_first_ambiguous[i]; a < m_first_ambiguous[i + 1]; a++)
+    out[m_ambiguous[a]] = 'N';
+}
+
+void ReadStore::quality(uint32_t i, std::string &out) const {
+  if (!m_has_quality[i]) {
+    out.clear();
+    return;
+  }
+  const char *q = &m_qualities[m_offsets[i]];
+  out.assign(q, q + m_lengths[i]);
+}
+
+SeqLib::UnalignedSequence ReadStore::unaligned(uint32_t i) const {
+  SeqLib::UnalignedSequence s;
+  s.Name = name(i);
+  sequence(i, s.Seq);
+  quality(i, s.Qual);
+  return s;
+}
+
+void ReadStore::codes(uint32_t i, std::vector<uint8_t> &out) const {
+  uint64_t offset = m_offsets[i];
+  uint32_t len = m_lengths[i];
+  out.resize(len);
+  for (uint32_t j = 0; j < len; j++)
+    out[j] = baseCode(offset + j);
+  for (uint32_t a = m_first_ambiguous[i]; a < m_first_ambiguous[i + 1]; a++)
+    out[m_ambiguous[a]] = 4;
+}
+
+void ReadStore::retain(const std::vector<bool> &keep) {
+  ReadStore kept;
+  for (uint32_t i = 0; i < size(); i++) {
+    if (!keep[i])
+      continue;
+    uint64_t offset = kept.m_qualities.size();
+    uint32_t len = m_lengths[i];
+    kept.m_offsets.push_back(offset);
+    kept.m_lengths.push_back(len);
+    kept.m_names.push_back(kept.internName(name(i)));
+    kept.m_barcodes.push_back(m_barcodes[i]);
+
+    kept.m_bases.resize((offset + len + 3) / 4, 0);
+    for (uint32_t j = 0; j < len; j++)
+      kept.setBaseCode(offset + j, baseCode(m_offsets[i] + j));
+    kept.m_ambiguous.insert(kept.m_ambiguous.end(),
+                            m_ambiguous.begin() + m_first_ambiguous[i],
+                            m_ambiguous.begin() + m_first_ambiguous[i + 1]);
+    kept.m_first_ambiguous.push_back(kept.m_ambiguous.size());
+
+    kept.m_has_quality.push_back(m_has_quality[i]);
+    kept.m_qualities.insert(kept.m_qualities.end(), m_qualities.begin() + m_offsets[i],
+                            m_qualities.begin() + m_offsets[i] + len);
+  }
+  *this = std::move(kept);
+}
@@ -0,0 +1,88 @@
+#ifndef READ_STORE_H
+#define READ_STORE_H
+
+#include "BxBarcode.h"
+#include "ReadFingerprint.h"
+#include "SeqLib/UnalignedSequence.h"
+#include "htslib/sam.h"
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Positions of reads in a ReadStore. Subsets of the reads of a window, like the
+// reads of one phase, are passed around as lists of positions.
+typedef std::vector<uint32_t> ReadIds;
+
+class ReadStore {
+    /* Columnar store of the reads of an assembly window. Only what the
+       assembly and the read mapping need is kept: the name, the sequence
+       packed at 2 bits per base, the base qualities and the barcode.
+
+       Sequences and qualities are appended to two arenas. Names are interned
+       in a string pool, so both mates of a pair share one name. The few
+       ambiguous bases are kept apart, as positions into the read.
+    */
+
+public:
+    ReadStore();
+
+    // Copies the read out of a raw record and returns its position.
+    uint32_t append(const bam1_t *b, BxBarcodeId barcode);
+    size_t size() const;
+    bool empty() const;
+    void clear();
+    // heap memory held by the store
+    size_t bytes() const;
+    // total length of the reads
+    uint64_t bases() const;
+
+    const char *name(uint32_t i) const;
+    // equal for reads with the same name, like the two mates of a pair
+    uint32_t nameId(uint32_t i) const;
+    // number of distinct names, name ids are below it
+    size_t nameCount() const;
+    uint32_t length(uint32_t i) const;
+    BxBarcodeId barcode(uint32_t i) const;
+    // Decodes into out, whose capacity is reused between calls.
+    void sequence(uint32_t i, std::string &out) const;
+    // Phred+33, empty if the record had no qualities.
+    void quality(uint32_t i, std::string &out) const;
+    SeqLib::UnalignedSequence unaligned(uint32_t i) const;
+    // 2-bit codes of the bases, 4 for ambiguous ones
+    void codes(uint32_t i, std::vector<uint8_t> &out) const;
+
+    // Drops the reads that are not kept, and compacts the arenas. Positions
+    // of the kept reads change.
+    void retain(const std::vector<bool> &keep);
+
+private:
+    uint32_t internName(const char *name);
+    uint8_t baseCode(uint64_t k) const {
+      return (m_bases[k >> 2] >> ((k & 3) << 1)) & 3;
+    }
+    void setBaseCode(uint64_t k, uint8_t code) {
+      m_bases[k >> 2] |= code << ((k & 3) << 1);
+    }
+
+    // per read columns
+    std::vector<uint64_t> m_offsets;     // first base in the arenas
+    std::vector<uint32_t> m_lengths;
+    std::vector<uint32_t> m_names;
+    std::vector<BxBarcodeId> m_barcodes;
+    std::vector<uint32_t> m_first_ambiguous; // size() + 1 entries
+    std::vector<bool> m_has_quality;
+
+    // arenas
+    std::vector<uint8_t> m_bases;        // 4 bases per byte
+    std::vector<char> m_qualities;       // one byte per base
+    std::vector<uint32_t> m_ambiguous;   // positions of N in their read
+
+    // string pool
+    std::vector<char> m_name_pool;       // NUL terminated names
+    std::vector<uint32_t> m_name_offsets;
+    std::unordered_map<std::string, uint32_t> m_name_ids;
+};
+
+#endif
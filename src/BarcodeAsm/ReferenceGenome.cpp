@@ -0,0 +1,102 @@
+#include "ReferenceGenome.h"
+#include "htslib/faidx.h"
+#include <algorithm>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+ReferenceGenome::ReferenceGenome() : m_data(NULL), m_size(0) {}
+
+ReferenceGenome::~ReferenceGenome() {
+  if (m_data)
+    munmap((void *)m_data, m_size);
+}
+
+bool ReferenceGenome::load(const std::string &fasta_path) {
+  std::string fai_path = fasta_path + ".fai";
+  if (access(fai_path.c_str(), R_OK) != 0 && fai_build(fasta_path.c_str()) != 0) {
+    std::cerr << "Could not index " << fasta_path << std::endl;
+    return false;
+  }
+  if (!loadFai(fai_path))
+    return false;
+
+  int fd = open(fasta_path.c_str(), O_RDONLY);
+  if (fd < 0)
+    return false;
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size == 0) {
+    close(fd);
+    return false;
+  }
+  void *data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED)
+    return false;
+  m_data = (const char *)data;
+  m_size = st.st_size;
+
+  // a bgzip compressed FASTA has an index too, but its offsets are not
+  // offsets into the file
+  if (m_size >= 2 && (uint8_t)m_data[0] == 0x1f && (uint8_t)m_data[1] == 0x8b) {
+    std::cerr << fasta_path << " must be an uncompressed FASTA file" << std::endl;
+    return false;
+  }
+  for (auto &e : m_entries) {
+    const FaiEntry &f = e.second;
+    uint64_t end = f.offset + f.length / f.line_bases * f.line_bytes + f.length % f.line_bases;
+    if (end > m_size) {
+      std::cerr << fasta_path << ".fai does not match the FASTA file" << std::endl;
+      return false;
+    }
+  }
+  return true;
+}
+
+bool ReferenceGenome::loadFai(const std::string &fai_path) {
+  std::ifstream fai(fai_path);
+  if (!fai)
+    return false;
+  std::string line;
+  while (std::getline(fai, line)) {
+    std::istringstream fields(line);
+    std::string name;
+    FaiEntry e;
+    if (!(fields >> name >> e.length >> e.offset >> e.line_bases >> e.line_bytes) ||
+        e.line_bases == 0 || e.line_bytes < e.line_bases) {
+      std::cerr << "Invalid line in " << fai_path << ": " << line << std::endl;
+      return false;
+    }
+    m_entries[name] = e;
+  }
+  return true;
+}
+
+bool ReferenceGenome::fetch(const std::string &chr, size_t start, size_t end, std::string &out) const {
+  out.clear();
+  auto it = m_entries.find(chr);
+  if (it == m_entries.end())
+    return false;
+  const FaiEntry &e = it->second;
+  if (e.length == 0 || start >= e.length || start > end)
+    return true;
+  end = std::min<uint64_t>(end, e.length - 1);
+
+  // copy the bases line by line, leaving the line ends out
+  out.resize(end - start + 1);
+  size_t pos = start, copied = 0;
+  while (pos <= end) {
+    uint64_t line = pos / e.line_bases, column = pos % e.line_bases;
+    size_t n = std::min<uint64_t>(e.line_bases - column, end - pos + 1);
+    uint64_t offset = e.offset + line * e.line_bytes + column;
+    memcpy(&out[copied], m_data + offset, n);
+    copied += n;
+    pos += n;
+  }
+  return true;
+}
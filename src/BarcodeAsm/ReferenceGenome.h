@@ -0,0 +1,45 @@
+#ifndef REFERENCE_GENOME_H
+#define REFERENCE_GENOME_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+
+class ReferenceGenome {
+  /* Uncompressed FASTA file mapped in memory, with the offsets of its
+     sequences read from its .fai index. One instance is shared by all
+     threads: fetching only reads the mapping, so it needs no locking, and
+     the pages are shared with the page cache.
+  */
+
+public:
+  ReferenceGenome();
+  ~ReferenceGenome();
+  ReferenceGenome(const ReferenceGenome &) = delete;
+  ReferenceGenome &operator=(const ReferenceGenome &) = delete;
+
+  // Builds the .fai index if it is missing. Fails for compressed FASTA.
+  bool load(const std::string &fasta_path);
+
+  // Copies the bases from start to end, both included and 0-based like
+  // SeqLib::RefGenome::QueryRegion, into out, whose capacity is reused.
+  // The end is clamped to the sequence. Returns false for unknown names.
+  bool fetch(const std::string &chr, size_t start, size_t end, std::string &out) const;
+
+private:
+  struct FaiEntry {
+    uint64_t length;
+    uint64_t offset;
+    uint64_t line_bases;
+    uint64_t line_bytes;
+  };
+
+  bool loadFai(const std::string &fai_path);
+
+  const char *m_data;
+  size_t m_size;
+  std::unordered_map<std::string, FaiEntry> m_entries;
+};
+
+#endif
@@ -0,0 +1,61 @@
+#include "ReferenceIndex.h"
+#include "LocalAlignment.h"
+#include <iostream>
+
+ReferenceIndex::ReferenceIndex() : m_minimap_index(NULL) {}
+
+ReferenceIndex::~ReferenceIndex() {
+  if (m_minimap_index)
+    mm_idx_destroy(m_minimap_index);
+}
+
+bool ReferenceIndex::load(const std::string &path, int num_threads) {
+  if (mm_idx_is_idx(path.c_str()) != 1) {
+    std::cerr << path << " is not a minimap2 index" << std::endl;
+    return false;
+  }
+  // the minimizer options are read from the index itself
+  mm_idxopt_t index_opt;
+  mm_mapopt_t map_opt;
+  mm_set_opt(0, &index_opt, &map_opt);
+  mm_idx_reader_t *reader = mm_idx_reader_open(path.c_str(), &index_opt, NULL);
+  if (reader == NULL)
+    return false;
+  m_minimap_index = mm_idx_reader_read(reader, num_threads);
+  mm_idx_t *next_part = mm_idx_reader_read(reader, num_threads);
+  mm_idx_reader_close(reader);
+  if (next_part != NULL)
+    mm_idx_destroy(next_part);
+  if (m_minimap_index == NULL || next_part != NULL) {
+    std::cerr << path << " must be a single part index, build it with a larger -I" << std::endl;
+    return false;
+  }
+
+  for (uint32_t i = 0; i < m_minimap_index->n_seq; i++)
+    m_chromosomes[m_minimap_index->seq[i].name] = i;
+
+  // Counting the occurrences of the minimizers over the whole genome is
+  // done once here, not for each window.
+  m_map_opt = LocalAlignment::tunedMapOpt();
+  // Primary and secondary hits are chosen over the whole genome, before the
+  // hits outside of the window are dropped. Only the chains kept are aligned
+  // base by base, so aligning all of them would be too slow on repeats.
+  // More secondary hits are kept than by default instead, so that a repeat
+  // elsewhere only hides the hit of the window when the contig has more than
+  // MAX_SECONDARY_HITS copies as good in the genome.
+  m_map_opt.best_n = MAX_SECONDARY_HITS;
+  mm_mapopt_update(&m_map_opt, m_minimap_index);
+  mm_idx_stat(m_minimap_index);
+  return true;
+}
+
+const mm_idx_t *ReferenceIndex::index() const { return m_minimap_index; }
+
+const mm_mapopt_t &ReferenceIndex::mapOpt() const { return m_map_opt; }
+
+int ReferenceIndex::chromosome(const std::string &name) const {
+  auto it = m_chromosomes.find(name);
+  return it == m_chromosomes.end() ? -1 : it->second;
+}
+
+uint32_t ReferenceIndex::length(int rid) const { return m_minimap_index->seq[rid].len; }
@@ -0,0 +1,38 @@
+#ifndef REFERENCE_INDEX_H
+#define REFERENCE_INDEX_H
+
+#include "minimap2/minimap.h"
+#include <string>
+#include <unordered_map>
+
+class ReferenceIndex {
+  /* Whole genome minimap2 index, as written by `minimap2 -d`, loaded once and
+     shared read-only by all workers. Contigs are mapped against it with the
+     options of the per-window alignments, set up once for the whole genome.
+  */
+
+public:
+  ReferenceIndex();
+  ~ReferenceIndex();
+  ReferenceIndex(const ReferenceIndex &) = delete;
+  ReferenceIndex &operator=(const ReferenceIndex &) = delete;
+
+  // Fails for files that are not an index, or indexes split in parts.
+  bool load(const std::string &path, int num_threads);
+
+  const mm_idx_t *index() const;
+  const mm_mapopt_t &mapOpt() const;
+  // minimap2 id of a chromosome, -1 if it is not in the index
+  int chromosome(const std::string &name) const;
+  uint32_t length(int rid) const;
+
+  // secondary hits kept for each primary hit of a contig
+  static const int MAX_SECONDARY_HITS = 50;
+
+private:
+  mm_idx_t *m_minimap_index;
+  mm_mapopt_t m_map_opt;
+  std::unordered_map<std::string, int> m_chromosomes;
+};
+
+#endif
@@ -17,3 +17,31 @@ RegionFileReader::RegionFileReader(const std::string &path, SeqLib::BamHeader he
 SeqLib::GenomicRegionVector RegionFileReader::getRegions() const {
     return m_regions;
 }
+
+std::vector<RegionGroup> RegionFileReader::getGroups(int max_distance) const {
+    std::vector<size_t> order(m_regions.size());
+    for(size_t i = 0; i < order.size(); i++)
+        order[i] = i;
+    if(max_distance >= 0)
+        std::stable_sort(order.begin(), order.end(), [this](size_t a, size_t b) {
+            const SeqLib::GenomicRegion &ra = m_regions[a], &rb = m_regions[b];
+            return ra.chr < rb.chr || (ra.chr == rb.chr && ra.pos1 < rb.pos1);
+        });
+
+    std::vector<RegionGroup> groups;
+    for(size_t i : order) {
+        const SeqLib::GenomicRegion &region = m_regions[i];
+        if(max_distance >= 0 && !groups.empty() && groups.back().span.chr == region.chr &&
+           region.pos1 - groups.back().span.pos2 <= max_distance) {
+            RegionGroup &group = groups.back();
+            group.span.pos2 = std::max(group.span.pos2, region.pos2);
+            group.windows.push_back(i);
+            continue;
+        }
+        RegionGroup group;
+        group.span = SeqLib::GenomicRegion(region.chr, region.pos1, region.pos2);
+        group.windows.push_back(i);
+        groups.push_back(group);
+    }
+    return groups;
+}
@@ -3,8 +3,16 @@
 
 #include "SeqLib/BamHeader.h"
 #include "SeqLib/GenomicRegion.h"
+#include <algorithm>
 #include <fstream>
 #include <string>
+#include <vector>
+
+/* Windows close enough to fetch their reads together */
+struct RegionGroup {
+    SeqLib::GenomicRegion span;  // covers all windows of the group
+    std::vector<size_t> windows; // positions in getRegions(), in start order
+};
 
 class RegionFileReader {
 
@@ -12,6 +20,10 @@ public:
     RegionFileReader(const std::string &path, SeqLib::BamHeader header);
 
     SeqLib::GenomicRegionVector getRegions() const;
+    // Groups the windows of a chromosome that overlap or are at most
+    // max_distance bases apart. Every window is its own group if
+    // max_distance is negative.
+    std::vector<RegionGroup> getGroups(int max_distance) const;
 
 private:
     std::string m_path;
@@ -0,0 +1,123 @@
+#include "WindowGroup.h"
+#include <algorithm>
+
+WindowGroup::WindowGroup(const RegionGroup &group, const SeqLib::GenomicRegionVector &regions,
+                         HtsBamReader bam, BxBamWalker bx_bam, AssemblyParams params)
+    : m_span(group.span), m_bam(bam), m_bx_bam(bx_bam) {
+  for (size_t w : group.windows) {
+    m_regions.push_back(regions[w]);
+    m_windows.emplace_back(new LocalAssemblyWindow(regions[w], bam, bx_bam, params));
+  }
+}
+
+void WindowGroup::retrieveGenomewideReads(MemoryBudget *budget) {
+  size_t n = m_windows.size();
+  std::cerr << "Group " << m_span.ToString(m_bam.Header()) << " of " << n << " windows" << std::endl;
+
+  // Shared stages are timed for the whole group, then split evenly
+  WindowStats group_stats;
+  {
+    StageTimer timer(group_stats, STAGE_LOCAL_FETCH);
+    m_bam.SetRegion(m_span);
+    bam1_t *b = bam_init1();
+    while (m_bam.GetNextRecord(b))
+      for (auto &win : m_windows)
+        if (win->overlaps(b))
+          win->addLocalRead(b);
+    bam_destroy1(b);
+  }
+
+  std::vector<BxBarcodeId> barcodes;
+  {
+    StageTimer timer(group_stats, STAGE_BARCODE_COLLECTION);
+    for (auto &win : m_windows) {
+      std::cerr << "Pre barcode collection: " << win->getReads().size() << std::endl;
+      win->reportBarcodes();
+      std::vector<BxBarcodeId> window_barcodes = win->getBarcodes();
+      barcodes.insert(barcodes.end(), window_barcodes.begin(), window_barcodes.end());
+    }
+    std::sort(barcodes.begin(), barcodes.end());
+    barcodes.erase(std::unique(barcodes.begin(), barcodes.end()), barcodes.end());
+  }
+
+  // An upper bound, since the read filter drops most barcode records
+  size_t estimate = 0;
+  {
+    StageTimer timer(group_stats, STAGE_MEMORY_WAIT);
+    uint64_t records;
+    for (auto &win : m_windows)
+      if (budget && m_bx_bam.countRecords(win->getBarcodes(), records))
+        estimate += win->estimateAssemblyBytes(records);
+    m_reservation.reset(new MemoryReservation(budget, estimate));
+  }
+
+  // Fetched reads are copied into a batch, which every window then
+  // deduplicates under one timer. The dedup is taken out of the fetch.
+  std::vector<bam1_t *> batch(DEDUP_BATCH, NULL);
+  std::vector<BxBarcodeId> batch_ids(DEDUP_BATCH);
+  size_t batch_size = 0;
+  WindowStats dedup_stats;
+  auto dedup_batch = [&]() {
+    StageTimer total(dedup_stats, STAGE_DEDUP);
+    for (auto &win : m_windows) {
+      StageTimer timer(win->getStats(), STAGE_DEDUP);
+      for (size_t r = 0; r < batch_size; r++)
+        if (win->hasBarcode(batch_ids[r]))
+          win->addGenomewideRead(batch[r], batch_ids[r]);
+    }
+    batch_size = 0;
+  };
+  {
+    StageTimer timer(group_stats, STAGE_GENOMEWIDE_FETCH);
+    m_bx_bam.fetchReadsByBxBarcode(barcodes, [&](BxBarcodeId id, const bam1_t *b) {
+        if (batch[batch_size] == NULL)
+          batch[batch_size] = bam_init1();
+        bam_copy1(batch[batch_size], b);
+        batch_ids[batch_size++] = id;
+        if (batch_size == DEDUP_BATCH)
+          dedup_batch();
+    });
+    dedup_batch();
+  }
+  for (bam1_t *b : batch)
+    if (b != NULL)
+      bam_destroy1(b);
+  StageTime &fetch = group_stats.stages[STAGE_GENOMEWIDE_FETCH];
+  fetch.wall = std::max(0.0, fetch.wall - dedup_stats.stages[STAGE_DEDUP].wall);
+  fetch.cpu = std::max(0.0, fetch.cpu - dedup_stats.stages[STAGE_DEDUP].cpu);
+
+  {
+    StageTimer timer(group_stats, STAGE_MEMORY_WAIT);
+    m_reservation->resize(footprint());
+  }
+
+  for (size_t i = 0; i < n; i++) {
+    WindowStats &stats = m_windows[i]->getStats();
+    stats.addShare(STAGE_LOCAL_FETCH, group_stats.stages[STAGE_LOCAL_FETCH], n);
+    stats.addShare(STAGE_BARCODE_COLLECTION, group_stats.stages[STAGE_BARCODE_COLLECTION], n);
+    stats.addShare(STAGE_GENOMEWIDE_FETCH, fetch, n);
+    stats.addShare(STAGE_MEMORY_WAIT, group_stats.stages[STAGE_MEMORY_WAIT], n);
+    std::cerr << "Post barcode collection: " << m_windows[i]->getReads().size() << std::endl;
+    m_windows[i]->reportDuplicates();
+  }
+}
+
+size_t WindowGroup::size() const { return m_windows.size(); }
+
+const SeqLib::GenomicRegion &WindowGroup::region(size_t i) const { return m_regions[i]; }
+
+LocalAssemblyWindow &WindowGroup::window(size_t i) { return *m_windows[i]; }
+
+void WindowGroup::release(size_t i) {
+  m_windows[i].reset();
+  if (m_reservation)
+    m_reservation->resize(footprint());
+}
+
+size_t WindowGroup::footprint() const {
+  size_t bytes = 0;
+  for (auto &win : m_windows)
+    if (win)
+      bytes += win->estimateAssemblyBytes();
+  return bytes;
+}
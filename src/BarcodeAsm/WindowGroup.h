@@ -0,0 +1,56 @@
+#ifndef WINDOW_GROUP_H
+#define WINDOW_GROUP_H
+
+#include "BxBamWalker.h"
+#include "HtsBamReader.h"
+#include "LocalAssemblyWindow.h"
+#include "MemoryBudget.h"
+#include "RegionFileReader.h"
+#include "SeqLib/GenomicRegion.h"
+#include <memory>
+#include <vector>
+
+class WindowGroup {
+    /* Assembly windows that fetch their reads together. The local reads of
+       the group span are read once and handed to the windows they overlap.
+       The genome wide reads of the union of their barcodes are then fetched
+       once and handed to the windows that have the barcode. Each window ends
+       up with the same reads, in the same order, as if it had fetched them
+       itself. Assembly and output stay per window.
+
+       With a memory budget, the group reserves the estimated footprint of
+       its windows before the genome wide fetch, from the record counts of
+       the barcode index. The reservation is then cut to the footprint of the
+       reads actually kept, and shrinks as windows are released. Without
+       counts (sidecar index), it is only reserved once the reads are fetched.
+    */
+
+public:
+    WindowGroup(const RegionGroup &group, const SeqLib::GenomicRegionVector &regions,
+                HtsBamReader bam, BxBamWalker bx_bam, AssemblyParams params);
+
+    void retrieveGenomewideReads(MemoryBudget *budget = NULL);
+
+    size_t size() const;
+    const SeqLib::GenomicRegion &region(size_t i) const;
+    LocalAssemblyWindow &window(size_t i);
+    // Frees a window once it has been processed, and its share of the
+    // reservation.
+    void release(size_t i);
+
+    // genome wide reads deduplicated at once by each window
+    static const size_t DEDUP_BATCH = 4096;
+
+private:
+    // estimated assembly footprint of the windows not yet released
+    size_t footprint() const;
+
+    SeqLib::GenomicRegion m_span;
+    SeqLib::GenomicRegionVector m_regions;
+    std::vector<std::unique_ptr<LocalAssemblyWindow>> m_windows;
+    HtsBamReader m_bam;
+    BxBamWalker m_bx_bam;
+    std::unique_ptr<MemoryReservation> m_reservation;
+};
+
+#endif
@@ -0,0 +1,380 @@
+#include "WindowOutputs.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <sys/stat.h>
+#include <unistd.h>
+
+const char *WindowOutputs::CONTIGS_FILE = "contigs.fa";
+const char *WindowOutputs::HITS_FILE = "hits.tsv";
+const char *WindowOutputs::ALIGNMENTS_FILE = "alignments.tsv";
+const char *WindowOutputs::JOURNAL_FILE = "windows.journal";
+const char *WindowOutputs::SHARD_FILE = "windows.shard";
+const char *WindowOutputs::REORDER_DIR = "reorder.tmp";
+
+WindowOutputs::WindowOutputs(const std::string &dir, const std::string &alignment_header,
+                             bool resume)
+    : m_dir(dir), m_in_order(true), m_max_window(0) {
+  if (!dir.empty() && mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST)
+    throw std::runtime_error("Could not create " + dir);
+  moveReordered();
+  // large buffers, set before the files are opened
+  std::ofstream *files[3] = {&m_contigs, &m_hits, &m_alignments};
+  for (int f = 0; f < 3; f++) {
+    m_buffers[f].resize(BUFFER_SIZE);
+    files[f]->rdbuf()->pubsetbuf(m_buffers[f].data(), m_buffers[f].size());
+  }
+  if (resume && loadJournal(m_sizes)) {
+    // drop what was written after the last journaled window
+    if (truncate(path(CONTIGS_FILE).c_str(), m_sizes[0]) != 0 ||
+        truncate(path(HITS_FILE).c_str(), m_sizes[1]) != 0 ||
+        truncate(path(ALIGNMENTS_FILE).c_str(), m_sizes[2]) != 0)
+      throw std::runtime_error("Could not truncate the outputs in " + dir + " to resume");
+    m_contigs.open(path(CONTIGS_FILE), std::ios::app);
+    m_hits.open(path(HITS_FILE), std::ios::app);
+    m_alignments.open(path(ALIGNMENTS_FILE), std::ios::app);
+    m_journal.open(path(JOURNAL_FILE), std::ios::app);
+    std::cerr << "Resuming after " << m_completed.size() << " completed windows" << std::endl;
+  } else {
+    m_completed.clear();
+    m_contigs.open(path(CONTIGS_FILE));
+    m_hits.open(path(HITS_FILE));
+    m_alignments.open(path(ALIGNMENTS_FILE));
+    m_journal.open(path(JOURNAL_FILE));
+    // the header is part of the first window's journaled size
+    m_alignments << alignment_header << "\n";
+    m_sizes[0] = m_sizes[1] = 0;
+    m_sizes[2] = alignment_header.size() + 1;
+  }
+  if (!m_contigs || !m_hits || !m_alignments || !m_journal)
+    throw std::runtime_error("Could not open the outputs in " + (dir.empty() ? "." : dir));
+}
+
+std::vector<JournalEntry> WindowOutputs::readJournal(const std::string &journal_path,
+                                                     uint64_t *complete_bytes) {
+  std::vector<JournalEntry> entries;
+  std::ifstream in(journal_path);
+  std::string line;
+  uint64_t bytes = 0;
+  if (complete_bytes)
+    *complete_bytes = 0;
+  while (std::getline(in, line)) {
+    bytes += line.size() + 1;
+    // a line cut by the interruption has no newline
+    if (in.eof())
+      break;
+    std::stringstream fields(line);
+    JournalEntry entry;
+    if (!(fields >> entry.window >> entry.name >> entry.sizes[0] >> entry.sizes[1] >>
+          entry.sizes[2]))
+      break;
+    entries.push_back(entry);
+    if (complete_bytes)
+      *complete_bytes = bytes;
+  }
+  return entries;
+}
+
+bool WindowOutputs::loadJournal(uint64_t sizes[3]) {
+  uint64_t complete_bytes;
+  std::vector<JournalEntry> entries = readJournal(path(JOURNAL_FILE), &complete_bytes);
+  if (entries.empty())
+    return false;
+  for (const JournalEntry &entry : entries) {
+    if (!m_completed.empty() && entry.window < m_max_window)
+      m_in_order = false;
+    m_max_window = std::max(m_max_window, entry.window);
+    m_completed[entry.window] = entry.name;
+  }
+  for (int f = 0; f < 3; f++)
+    sizes[f] = entries.back().sizes[f];
+  if (truncate(path(JOURNAL_FILE).c_str(), complete_bytes) != 0)
+    throw std::runtime_error("Could not truncate " + path(JOURNAL_FILE));
+  return true;
+}
+
+std::string WindowOutputs::path(const char *file) const { return path(m_dir, file); }
+
+std::string WindowOutputs::path(const std::string &dir, const char *file) {
+  return dir.empty() ? std::string(file) : dir + "/" + file;
+}
+
+bool WindowOutputs::isComplete(size_t window) const {
+  return m_completed.count(window) > 0;
+}
+
+size_t WindowOutputs::completedWindows() const { return m_completed.size(); }
+
+void WindowOutputs::commit(const std::vector<WindowRecord> &records) {
+  if (records.empty())
+    return;
+  std::lock_guard<std::mutex> lock(m_mutex);
+  for (const WindowRecord &r : records) {
+    m_contigs << r.contigs;
+    m_hits << r.hits;
+    m_alignments << r.alignments;
+  }
+  m_contigs.flush();
+  m_hits.flush();
+  m_alignments.flush();
+  if (!m_contigs || !m_hits || !m_alignments)
+    throw std::runtime_error("Could not write the outputs of window " + records.back().name);
+  // only journal the windows once their outputs reached the files
+  for (const WindowRecord &r : records) {
+    m_sizes[0] += r.contigs.size();
+    m_sizes[1] += r.hits.size();
+    m_sizes[2] += r.alignments.size();
+    m_journal << r.window << "\t" << r.name << "\t" << m_sizes[0] << "\t"
+              << m_sizes[1] << "\t" << m_sizes[2] << "\n";
+    if (!m_completed.empty() && r.window < m_max_window)
+      m_in_order = false;
+    m_max_window = std::max(m_max_window, r.window);
+    m_completed[r.window] = r.name;
+  }
+  m_journal.flush();
+}
+
+void WindowOutputs::close() {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  m_contigs.close();
+  m_hits.close();
+  m_alignments.close();
+  m_journal.close();
+  if (!m_in_order)
+    reorder();
+}
+
+void WindowOutputs::reorder() {
+  std::vector<std::string> dirs(1, m_dir);
+  std::vector<Segment> segments;
+  std::string alignment_header;
+  if (!readSegments(dirs, 0, segments, alignment_header))
+    throw std::runtime_error("Could not read the outputs in " + (m_dir.empty() ? "." : m_dir));
+  std::stable_sort(segments.begin(), segments.end(),
+                   [](const Segment &a, const Segment &b) { return a.window < b.window; });
+  std::string staging = path(REORDER_DIR);
+  if (mkdir(staging.c_str(), 0755) != 0 && errno != EEXIST)
+    throw std::runtime_error("Could not create " + staging);
+  // the journal of the staging directory is only named once it is complete
+  if (!writeSegments(dirs, segments, alignment_header, staging))
+    throw std::runtime_error("Could not put the outputs back in window order");
+  moveReordered();
+  m_in_order = true;
+}
+
+void WindowOutputs::moveReordered() {
+  std::string staging = path(REORDER_DIR);
+  const char *files[4] = {CONTIGS_FILE, HITS_FILE, ALIGNMENTS_FILE, JOURNAL_FILE};
+  bool complete = access(path(staging, JOURNAL_FILE).c_str(), F_OK) == 0;
+  for (const char *file : files) {
+    std::string staged = path(staging, file);
+    if (!complete || access(staged.c_str(), F_OK) != 0)
+      std::remove(staged.c_str());
+    else if (rename(staged.c_str(), path(file).c_str()) != 0)
+      throw std::runtime_error("Could not move " + staged);
+  }
+  std::remove((path(staging, JOURNAL_FILE) + ".tmp").c_str());
+  rmdir(staging.c_str());
+}
+
+std::string WindowOutputs::spillPath(size_t window) const {
+  return path(m_dir, ("window_" + std::to_string(window) + ".spill").c_str());
+}
+
+void WindowOutputs::writeShardWindows(int shard, int num_shards, size_t total,
+                                      const std::vector<size_t> &windows) {
+  std::ofstream out(path(SHARD_FILE));
+  out << shard << "\t" << num_shards << "\t" << total << "\n";
+  for (size_t w : windows)
+    out << w << "\n";
+  out.flush();
+  if (!out)
+    throw std::runtime_error("Could not write " + path(SHARD_FILE));
+}
+
+bool WindowOutputs::readShardWindows(const std::string &dir, ShardWindows &shard) {
+  std::ifstream in(path(dir, SHARD_FILE));
+  if (!(in >> shard.shard >> shard.num_shards >> shard.total))
+    return false;
+  shard.windows.clear();
+  size_t w;
+  while (in >> w)
+    shard.windows.push_back(w);
+  return in.eof();
+}
+
+bool WindowOutputs::checkShards(const std::vector<std::string> &dirs,
+                                const std::vector<Segment> &segments) {
+  bool complete = true;
+  std::vector<bool> seen_shards;
+  size_t total = 0;
+  std::vector<size_t> given;
+  for (size_t d = 0; d < dirs.size(); d++) {
+    ShardWindows shard;
+    if (!readShardWindows(dirs[d], shard)) {
+      std::cerr << "No list of windows in " << dirs[d] << std::endl;
+      complete = false;
+      continue;
+    }
+    if (seen_shards.empty() && shard.num_shards > 0) {
+      seen_shards.resize(shard.num_shards, false);
+      total = shard.total;
+    }
+    if (shard.num_shards != (int)seen_shards.size() || shard.total != total ||
+        shard.shard < 1 || shard.shard > shard.num_shards) {
+      std::cerr << dirs[d] << " is a shard of another run" << std::endl;
+      complete = false;
+      continue;
+    }
+    if (seen_shards[shard.shard - 1]) {
+      std::cerr << "Shard " << shard.shard << " is given twice" << std::endl;
+      complete = false;
+    }
+    seen_shards[shard.shard - 1] = true;
+    given.insert(given.end(), shard.windows.begin(), shard.windows.end());
+
+    // windows of the shard that are not in its journal
+    size_t missing = 0;
+    for (size_t w : shard.windows) {
+      auto it = std::lower_bound(segments.begin(), segments.end(), w,
+                                 [](const Segment &s, size_t w) { return s.window < w; });
+      if (it == segments.end() || it->window != w || it->dir != d)
+        missing++;
+    }
+    if (missing > 0) {
+      std::cerr << missing << " of the " << shard.windows.size() << " windows of " << dirs[d]
+                << " are not complete" << std::endl;
+      complete = false;
+    }
+  }
+  for (size_t s = 0; s < seen_shards.size(); s++)
+    if (!seen_shards[s]) {
+      std::cerr << "Shard " << s + 1 << " of " << seen_shards.size() << " is missing"
+                << std::endl;
+      complete = false;
+    }
+  // the shards of a run split the windows of the regions between them
+  std::sort(given.begin(), given.end());
+  if (std::adjacent_find(given.begin(), given.end()) != given.end() ||
+      (!given.empty() && given.back() >= total) || (complete && given.size() != total)) {
+    std::cerr << "The shards do not split the " << total << " windows of the regions"
+              << std::endl;
+    complete = false;
+  }
+  return complete;
+}
+
+bool WindowOutputs::readSegments(const std::vector<std::string> &dirs, size_t d,
+                                 std::vector<Segment> &segments,
+                                 std::string &alignment_header) {
+  std::ifstream alignments(path(dirs[d], ALIGNMENTS_FILE));
+  if (!std::getline(alignments, alignment_header))
+    return false;
+  uint64_t begin[3] = {0, 0, alignment_header.size() + 1};
+  for (const JournalEntry &entry : readJournal(path(dirs[d], JOURNAL_FILE))) {
+    Segment segment;
+    segment.window = entry.window;
+    segment.name = entry.name;
+    segment.dir = d;
+    for (int f = 0; f < 3; f++) {
+      segment.begin[f] = begin[f];
+      segment.end[f] = begin[f] = entry.sizes[f];
+    }
+    segments.push_back(segment);
+  }
+  return true;
+}
+
+bool WindowOutputs::writeSegments(const std::vector<std::string> &dirs,
+                                  const std::vector<Segment> &segments,
+                                  const std::string &alignment_header,
+                                  const std::string &out_dir) {
+  const char *files[3] = {CONTIGS_FILE, HITS_FILE, ALIGNMENTS_FILE};
+  std::vector<std::unique_ptr<std::ifstream>> inputs;
+  for (size_t d = 0; d < dirs.size(); d++)
+    for (int f = 0; f < 3; f++)
+      inputs.emplace_back(new std::ifstream(path(dirs[d], files[f]), std::ios::binary));
+
+  std::ofstream outputs[3];
+  std::vector<char> buffers[3];
+  for (int f = 0; f < 3; f++) {
+    buffers[f].resize(BUFFER_SIZE);
+    outputs[f].rdbuf()->pubsetbuf(buffers[f].data(), buffers[f].size());
+    outputs[f].open(path(out_dir, files[f]), std::ios::binary);
+  }
+  // The journal only gets its name once the outputs are complete.
+  std::string journal_path = path(out_dir, JOURNAL_FILE);
+  std::ofstream journal(journal_path + ".tmp");
+
+  outputs[2] << alignment_header << "\n";
+  uint64_t sizes[3] = {0, 0, alignment_header.size() + 1};
+  std::string contents;
+  for (const Segment &segment : segments) {
+    for (int f = 0; f < 3; f++) {
+      std::ifstream &in = *inputs[segment.dir * 3 + f];
+      contents.resize(segment.end[f] - segment.begin[f]);
+      in.seekg(segment.begin[f]);
+      if (!in.read(&contents[0], contents.size())) {
+        std::cerr << "Truncated " << files[f] << " in " << dirs[segment.dir] << std::endl;
+        return false;
+      }
+      outputs[f] << contents;
+      sizes[f] += contents.size();
+    }
+    journal << segment.window << "\t" << segment.name << "\t" << sizes[0] << "\t"
+            << sizes[1] << "\t" << sizes[2] << "\n";
+  }
+
+  for (int f = 0; f < 3; f++)
+    outputs[f].close();
+  journal.close();
+  if (!outputs[0] || !outputs[1] || !outputs[2] || !journal ||
+      rename((journal_path + ".tmp").c_str(), journal_path.c_str()) != 0) {
+    std::cerr << "Could not write the outputs in " << (out_dir.empty() ? "." : out_dir)
+              << std::endl;
+    return false;
+  }
+  return true;
+}
+
+bool WindowOutputs::mergeShards(const std::vector<std::string> &shard_dirs,
+                                const std::string &out_dir, bool allow_partial) {
+  // byte ranges of every window in its shard outputs
+  std::vector<Segment> segments;
+  std::string alignment_header;
+  for (size_t s = 0; s < shard_dirs.size(); s++)
+    if (!readSegments(shard_dirs, s, segments, alignment_header)) {
+      std::cerr << "No outputs in " << shard_dirs[s] << std::endl;
+      return false;
+    }
+  std::sort(segments.begin(), segments.end(),
+            [](const Segment &a, const Segment &b) { return a.window < b.window; });
+  for (size_t i = 1; i < segments.size(); i++)
+    if (segments[i].window == segments[i - 1].window) {
+      std::cerr << "Window " << segments[i].name << " is in several shards" << std::endl;
+      return false;
+    }
+  if (!checkShards(shard_dirs, segments)) {
+    if (!allow_partial) {
+      std::cerr << "Not merging incomplete shards, resume them or use --allow-partial"
+                << std::endl;
+      return false;
+    }
+    std::cerr << "Merging incomplete shards" << std::endl;
+  }
+
+  // the merged outputs are journaled like those of a single run
+  if (!out_dir.empty() && mkdir(out_dir.c_str(), 0755) != 0 && errno != EEXIST) {
+    std::cerr << "Could not create " << out_dir << std::endl;
+    return false;
+  }
+  if (!writeSegments(shard_dirs, segments, alignment_header, out_dir))
+    return false;
+  std::cerr << "Merged " << segments.size() << " windows from " << shard_dirs.size()
+            << " shards" << std::endl;
+  return true;
+}
@@ -0,0 +1,147 @@
+#ifndef WINDOW_OUTPUTS_H
+#define WINDOW_OUTPUTS_H
+
+#include <cstdint>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/* One line of windows.journal: a completed window and the sizes of the
+   contigs, hits and alignments files once its outputs were written */
+struct JournalEntry {
+    size_t window;
+    std::string name;
+    uint64_t sizes[3];
+};
+
+/* Buffered outputs of one window */
+struct WindowRecord {
+    size_t window;
+    std::string name;
+    std::string contigs;
+    std::string hits;
+    std::string alignments;
+};
+
+class WindowOutputs {
+    /* Output files of a run: contigs.fa, hits.tsv and alignments.tsv, plus
+       windows.journal, an append-only list of the windows whose outputs are
+       complete. The outputs of a window are written together, flushed, and
+       only then journaled with the sizes of the three files, so the journal
+       never lists a half-written window.
+
+       Windows are written and journaled in window order (see WindowWriter).
+       On resume, the outputs are truncated to the sizes of the last journal
+       line, which drops whatever an interrupted run wrote after it, and the
+       windows left are appended, still in order. A window that failed and
+       is run again on resume is appended after the windows that followed it,
+       so close() then rewrites the outputs and the journal in window order.
+       The rewrite goes to a staging directory first, and is only moved over
+       the outputs once complete. An interrupted move is finished when the
+       outputs are opened again.
+
+       The journal gives the bytes of every window in the outputs. merge uses
+       it to put the windows of several shards back in window order. Each
+       shard also lists the windows it was given in windows.shard, so that
+       merge can check that no window is missing.
+    */
+
+public:
+    // Outputs go to dir (the working directory if empty), which is created
+    // if needed.
+    WindowOutputs(const std::string &dir, const std::string &alignment_header, bool resume);
+
+    bool isComplete(size_t window) const;
+    size_t completedWindows() const;
+
+    // Writes the outputs of the windows and journals them, with a single
+    // flush. Thread safe.
+    void commit(const std::vector<WindowRecord> &records);
+    // Closes the files, putting the windows back in order if needed.
+    void close();
+    // File of the outputs of a window held back by WindowWriter
+    std::string spillPath(size_t window) const;
+
+    // Complete lines of a journal. complete_bytes receives their length.
+    static std::vector<JournalEntry> readJournal(const std::string &path,
+                                                 uint64_t *complete_bytes = NULL);
+    // Lists the windows of shard i of num_shards, out of total windows.
+    void writeShardWindows(int shard, int num_shards, size_t total,
+                           const std::vector<size_t> &windows);
+    /* Writes the outputs of the shard directories to out_dir in window
+       order, as a single run writing its windows in order would have.
+       Refuses unless the shards are all there and journaled all of their
+       windows, or allow_partial is set. */
+    static bool mergeShards(const std::vector<std::string> &shard_dirs,
+                            const std::string &out_dir, bool allow_partial);
+
+    static const char *CONTIGS_FILE;
+    static const char *HITS_FILE;
+    static const char *ALIGNMENTS_FILE;
+    static const char *JOURNAL_FILE;
+    static const char *SHARD_FILE;
+    static const char *REORDER_DIR;
+    // stream buffer of each output file
+    static const size_t BUFFER_SIZE = 1 << 20;
+
+private:
+    /* Bytes of a window in the outputs of a directory */
+    struct Segment {
+        size_t window;
+        std::string name;
+        size_t dir; // index in the list of directories
+        uint64_t begin[3];
+        uint64_t end[3];
+    };
+
+    /* Windows given to a shard, from its windows.shard */
+    struct ShardWindows {
+        int shard;
+        int num_shards;
+        size_t total;
+        std::vector<size_t> windows;
+    };
+
+    // Reads the journal, returns false if there is nothing to resume from.
+    bool loadJournal(uint64_t sizes[3]);
+    // Appends the segments of the journaled windows of dirs[d], and reads
+    // the header of its alignments. Returns false if it has no outputs.
+    static bool readSegments(const std::vector<std::string> &dirs, size_t d,
+                             std::vector<Segment> &segments, std::string &alignment_header);
+    static bool readShardWindows(const std::string &dir, ShardWindows &shard);
+    // Reports the windows of the shards missing from the segments (sorted by
+    // window). Returns false if any is missing.
+    static bool checkShards(const std::vector<std::string> &dirs,
+                            const std::vector<Segment> &segments);
+    // Copies the segments, in this order, to the outputs of out_dir, and
+    // journals them.
+    static bool writeSegments(const std::vector<std::string> &dirs,
+                              const std::vector<Segment> &segments,
+                              const std::string &alignment_header, const std::string &out_dir);
+    // Rewrites the outputs in window order, through REORDER_DIR.
+    void reorder();
+    // Moves the outputs of a complete rewrite over the outputs, journal last,
+    // or drops those of an incomplete one.
+    void moveReordered();
+    std::string path(const char *file) const;
+    static std::string path(const std::string &dir, const char *file);
+
+    std::string m_dir;
+    std::ofstream m_contigs;
+    std::ofstream m_hits;
+    std::ofstream m_alignments;
+    std::ofstream m_journal;
+    std::vector<char> m_buffers[3];
+    // sizes of the contigs, hits and alignments files
+    uint64_t m_sizes[3];
+    // name of each completed window, by window index
+    std::unordered_map<size_t, std::string> m_completed;
+    // whether the windows were journaled in increasing order
+    bool m_in_order;
+    size_t m_max_window;
+    std::mutex m_mutex;
+};
+
+#endif
@@ -0,0 +1,120 @@
+#include "WindowScheduler.h"
+#include "LocalAssemblyWindow.h"
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <numeric>
+#include <sstream>
+
+WindowScheduler::WindowScheduler(const HtsBamReader &bam) : m_bam(bam) {}
+
+bool WindowScheduler::loadStats(const std::string &stats_path) {
+  std::ifstream in(stats_path);
+  std::string line;
+  if (!in || !std::getline(in, line))
+    return false;
+
+  // find the window name and the wall time of every stage in the header
+  int window_column = -1;
+  std::vector<bool> wall_columns;
+  std::stringstream header(line);
+  std::string field;
+  while (std::getline(header, field, '\t')) {
+    if (field == "Window")
+      window_column = wall_columns.size();
+    wall_columns.push_back(field.size() > 5 &&
+                           field.compare(field.size() - 5, 5, "_wall") == 0);
+  }
+  if (window_column < 0)
+    return false;
+
+  while (std::getline(in, line)) {
+    std::stringstream fields(line);
+    std::string window;
+    double seconds = 0.0;
+    for (size_t c = 0; std::getline(fields, field, '\t'); c++) {
+      if ((int)c == window_column)
+        window = field;
+      else if (c < wall_columns.size() && wall_columns[c])
+        seconds += std::atof(field.c_str());
+    }
+    if (!window.empty())
+      m_measured[window] = seconds;
+  }
+  std::cerr << "Loaded times of " << m_measured.size() << " windows from " << stats_path << std::endl;
+  return true;
+}
+
+std::vector<double>
+WindowScheduler::estimateCosts(const SeqLib::GenomicRegionVector &regions,
+                               bool with_times) const {
+  std::vector<double> costs(regions.size());
+  std::vector<bool> measured(regions.size(), false);
+  double measured_seconds = 0.0, measured_estimate = 0.0;
+  SeqLib::BamHeader header = m_bam.Header();
+
+  for (size_t i = 0; i < regions.size(); i++) {
+    const SeqLib::GenomicRegion &region = regions[i];
+    double estimate = (double)m_bam.estimateRegionBytes(region) + region.Width();
+    costs[i] = estimate;
+    if (!with_times || m_measured.empty())
+      continue;
+    auto it = m_measured.find(LocalAssemblyWindow::windowPrefix(region, header));
+    if (it != m_measured.end()) {
+      measured[i] = true;
+      measured_seconds += it->second;
+      measured_estimate += estimate;
+      costs[i] = it->second;
+    }
+  }
+
+  // bring the estimates of the windows without times to seconds
+  if (measured_estimate > 0.0) {
+    double seconds_per_unit = measured_seconds / measured_estimate;
+    for (size_t i = 0; i < regions.size(); i++)
+      if (!measured[i])
+        costs[i] *= seconds_per_unit;
+  }
+  return costs;
+}
+
+std::vector<double>
+WindowScheduler::groupCosts(const SeqLib::GenomicRegionVector &regions,
+                            const std::vector<RegionGroup> &groups, bool with_times) const {
+  std::vector<double> window_costs = estimateCosts(regions, with_times);
+  std::vector<double> costs(groups.size(), 0.0);
+  for (size_t g = 0; g < groups.size(); g++)
+    for (size_t w : groups[g].windows)
+      costs[g] += window_costs[w];
+  return costs;
+}
+
+std::vector<size_t> WindowScheduler::costOrder(const std::vector<double> &costs) {
+  std::vector<size_t> order(costs.size());
+  std::iota(order.begin(), order.end(), 0);
+  std::stable_sort(order.begin(), order.end(),
+                   [&costs](size_t a, size_t b) { return costs[a] > costs[b]; });
+  return order;
+}
+
+std::vector<size_t>
+WindowScheduler::order(const SeqLib::GenomicRegionVector &regions,
+                       const std::vector<RegionGroup> &groups) const {
+  return costOrder(groupCosts(regions, groups, true));
+}
+
+std::vector<int>
+WindowScheduler::assignShards(const SeqLib::GenomicRegionVector &regions,
+                              const std::vector<RegionGroup> &groups, int num_shards) const {
+  // The times of a previous run may differ between nodes, the BAM index not.
+  std::vector<double> costs = groupCosts(regions, groups, false);
+  std::vector<double> loads(num_shards, 0.0);
+  std::vector<int> shards(groups.size(), 0);
+  for (size_t g : costOrder(costs)) {
+    // ties go to the lowest shard
+    int shard = std::min_element(loads.begin(), loads.end()) - loads.begin();
+    shards[g] = shard;
+    loads[shard] += costs[g];
+  }
+  return shards;
+}
@@ -0,0 +1,55 @@
+#ifndef WINDOW_SCHEDULER_H
+#define WINDOW_SCHEDULER_H
+
+#include "HtsBamReader.h"
+#include "RegionFileReader.h"
+#include "SeqLib/GenomicRegion.h"
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+class WindowScheduler {
+    /* Orders assembly windows most expensive first, so that a dense window
+       at the end of the BED file does not run alone at the end of the job.
+
+       The cost of a window is estimated from the BAM index, as the bytes of
+       its reads plus its length. When the stats of a previous run are given
+       (--stats), their total wall time is used instead for the windows they
+       list, and the estimates of the other windows are scaled to seconds.
+    */
+
+public:
+    WindowScheduler(const HtsBamReader &bam);
+
+    // Loads the per window times of a previous --stats file.
+    bool loadStats(const std::string &stats_path);
+    // Estimated cost of each region, in the order of regions. Without
+    // with_times, the times of a previous run are ignored.
+    std::vector<double> estimateCosts(const SeqLib::GenomicRegionVector &regions,
+                                      bool with_times = true) const;
+    // Positions of the groups of regions, most expensive first, the cost of
+    // a group being the sum of its windows. Ties keep the group order.
+    std::vector<size_t> order(const SeqLib::GenomicRegionVector &regions,
+                              const std::vector<RegionGroup> &groups) const;
+    // Shard of each group, from 0 to num_shards - 1. Groups are given, most
+    // expensive first, to the least loaded shard (longest processing time
+    // first). Only the BAM index estimates are used, never the times of a
+    // previous run, so every node computes the same partition from the BAM
+    // and the regions.
+    std::vector<int> assignShards(const SeqLib::GenomicRegionVector &regions,
+                                  const std::vector<RegionGroup> &groups,
+                                  int num_shards) const;
+
+private:
+    std::vector<double> groupCosts(const SeqLib::GenomicRegionVector &regions,
+                                   const std::vector<RegionGroup> &groups,
+                                   bool with_times) const;
+    // Positions of the costs, largest first. Ties keep their order.
+    static std::vector<size_t> costOrder(const std::vector<double> &costs);
+
+    HtsBamReader m_bam;
+    // total wall time of the windows of a previous run, by window prefix
+    std::unordered_map<std::string, double> m_measured;
+};
+
+#endif
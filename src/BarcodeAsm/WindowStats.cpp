@@ -0,0 +1,68 @@
+#include "WindowStats.h"
+#include <sys/resource.h>
+#include <time.h>
+
+namespace {
+const char *STAGE_NAMES[NUM_WINDOW_STAGES] = {
+    "local_fetch", "barcode_collection", "genomewide_fetch",
+    "dedup", "kmer_filter", "memory_wait", "assembly", "contig_mapping",
+    "detect_sequences", "reference_alignment", "output"};
+}
+
+WindowStats::WindowStats() : m_peak_rss_start(peakRssKb()), m_peak_rss_delta(0) {}
+
+void WindowStats::addShare(WindowStage stage, const StageTime &time, size_t windows) {
+  stages[stage].wall += time.wall / windows;
+  stages[stage].cpu += time.cpu / windows;
+}
+
+void WindowStats::finish() { m_peak_rss_delta = peakRssKb() - m_peak_rss_start; }
+
+long WindowStats::peakRssDeltaKb() const { return m_peak_rss_delta; }
+
+std::string WindowStats::header() {
+  std::string h = "Window\tThread\tLocalReads\tGenomewideReads\tDuplicateReads\t"
+                  "KmerFilteredReads\tDownsampledReads\tReservedBytes\t"
+                  "Reads\tBarcodes\tContigs\tBytesRead\tPeakRssDeltaKb";
+  for (int s = 0; s < NUM_WINDOW_STAGES; s++) {
+    h += std::string("\t") + STAGE_NAMES[s] + "_wall";
+    h += std::string("\t") + STAGE_NAMES[s] + "_cpu";
+  }
+  return h;
+}
+
+void WindowStats::write(std::ostream &out, const std::string &window, int thread_id) const {
+  out << window << "\t" << thread_id << "\t" << local_reads << "\t"
+      << genomewide_reads << "\t" << duplicate_reads << "\t"
+      << kmer_filtered_reads << "\t" << downsampled_reads << "\t"
+      << reserved_bytes << "\t" << reads << "\t"
+      << barcodes << "\t" << contigs << "\t" << bytes_read << "\t"
+      << m_peak_rss_delta;
+  for (int s = 0; s < NUM_WINDOW_STAGES; s++)
+    out << "\t" << stages[s].wall << "\t" << stages[s].cpu;
+  out << "\n";
+}
+
+long WindowStats::peakRssKb() {
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) != 0)
+    return 0;
+  return usage.ru_maxrss;
+}
+
+double WindowStats::threadCpuSeconds() {
+  struct timespec ts;
+  if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) != 0)
+    return 0.0;
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+StageTimer::StageTimer(WindowStats &stats, WindowStage stage)
+    : m_time(stats.stages[stage]), m_wall_start(std::chrono::steady_clock::now()),
+      m_cpu_start(WindowStats::threadCpuSeconds()) {}
+
+StageTimer::~StageTimer() {
+  std::chrono::duration<double> wall = std::chrono::steady_clock::now() - m_wall_start;
+  m_time.wall += wall.count();
+  m_time.cpu += WindowStats::threadCpuSeconds() - m_cpu_start;
+}
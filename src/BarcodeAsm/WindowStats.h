@@ -0,0 +1,83 @@
+#ifndef WINDOW_STATS_H
+#define WINDOW_STATS_H
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <string>
+
+/* Stages of the processing of one assembly window, in pipeline order */
+enum WindowStage {
+  STAGE_LOCAL_FETCH,
+  STAGE_BARCODE_COLLECTION,
+  STAGE_GENOMEWIDE_FETCH,
+  STAGE_DEDUP,
+  STAGE_KMER_FILTER,
+  STAGE_MEMORY_WAIT,
+  STAGE_ASSEMBLY,
+  STAGE_CONTIG_MAPPING,
+  STAGE_DETECT_SEQUENCES,
+  STAGE_REFERENCE_ALIGNMENT,
+  STAGE_OUTPUT,
+  NUM_WINDOW_STAGES
+};
+
+struct StageTime {
+  double wall = 0.0; // seconds
+  double cpu = 0.0;  // seconds of the timing thread
+};
+
+class WindowStats {
+  /* Structured record of the work done for one window, written as one line
+     of the --stats TSV file. Times are in seconds, CPU time is that of the
+     thread that ran the stage. Peak RSS is process wide, so its delta is
+     only indicative when several windows run at once.
+  */
+
+public:
+  WindowStats();
+
+  StageTime stages[NUM_WINDOW_STAGES];
+  size_t local_reads = 0;
+  size_t genomewide_reads = 0;   // before dedup
+  size_t duplicate_reads = 0;
+  size_t kmer_filtered_reads = 0; // genome wide reads dropped by the k-mer filter
+  size_t downsampled_reads = 0;  // dropped to fit the memory budget
+  size_t reserved_bytes = 0;     // memory budget reserved for the assembly
+  size_t reads = 0;              // assembled
+  size_t barcodes = 0;
+  size_t contigs = 0;
+  uint64_t bytes_read = 0;       // uncompressed record bytes
+
+  // Adds a share of the time of a stage that ran for several windows at once.
+  void addShare(WindowStage stage, const StageTime &time, size_t windows);
+  // Records the growth of the peak RSS since the stats were created.
+  void finish();
+  long peakRssDeltaKb() const;
+
+  static std::string header();
+  void write(std::ostream &out, const std::string &window, int thread_id) const;
+
+  static long peakRssKb();
+  static double threadCpuSeconds();
+
+private:
+  long m_peak_rss_start;
+  long m_peak_rss_delta;
+};
+
+class StageTimer {
+  /* Adds the wall and thread CPU time of its scope to a stage */
+
+public:
+  StageTimer(WindowStats &stats, WindowStage stage);
+  ~StageTimer();
+
+private:
+  StageTime &m_time;
+  std::chrono::steady_clock::time_point m_wall_start;
+  double m_cpu_start;
+};
+
+#endif
@@ -0,0 +1,177 @@
+#include "WindowWriter.h"
+#include <cstdio>
+#include <fstream>
+#include <stdexcept>
+
+WindowWriter::WindowWriter(WindowOutputs &outputs, const std::vector<size_t> &windows,
+                           size_t max_pending_bytes, std::ostream *stats)
+    : m_outputs(outputs), m_windows(windows), m_max_pending_bytes(max_pending_bytes),
+      m_stats(stats), m_pending_bytes(0), m_next(0), m_finishing(false) {
+  m_thread = std::thread(&WindowWriter::run, this);
+}
+
+WindowWriter::~WindowWriter() {
+  try {
+    finish();
+  } catch (...) {
+  }
+}
+
+size_t WindowWriter::bytes(const WindowRecord &record) {
+  return record.contigs.size() + record.hits.size() + record.alignments.size();
+}
+
+void WindowWriter::submit(WindowRecord record, const WindowStats *stats, int thread_id) {
+  PendingRecord pending = {};
+  pending.has_stats = m_stats && stats;
+  if (pending.has_stats)
+    pending.stats = *stats;
+  pending.thread_id = thread_id;
+  pending.sizes[0] = record.contigs.size();
+  pending.sizes[1] = record.hits.size();
+  pending.sizes[2] = record.alignments.size();
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_error)
+      return;
+    // the next window to write is never spilled
+    pending.spilled = m_next < m_windows.size() && m_windows[m_next] != record.window &&
+                      m_pending_bytes + bytes(record) > m_max_pending_bytes;
+  }
+  // spilled by the worker, outside of the lock
+  if (pending.spilled) {
+    StageTimer timer(pending.stats, STAGE_OUTPUT);
+    spill(record);
+  }
+
+  std::lock_guard<std::mutex> lock(m_mutex);
+  if (m_error)
+    return;
+  size_t window = record.window;
+  if (!pending.spilled)
+    m_pending_bytes += bytes(record);
+  m_skipped.erase(window);
+  pending.record = std::move(record);
+  m_pending[window] = std::move(pending);
+  m_ready.notify_one();
+}
+
+void WindowWriter::skip(size_t window) {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  if (m_error || m_pending.count(window) > 0)
+    return;
+  m_skipped.insert(window);
+  m_ready.notify_one();
+}
+
+void WindowWriter::finish() {
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_finishing = true;
+  }
+  m_ready.notify_one();
+  if (m_thread.joinable())
+    m_thread.join();
+  if (m_error) {
+    std::exception_ptr error = m_error;
+    m_error = nullptr;
+    std::rethrow_exception(error);
+  }
+}
+
+void WindowWriter::spill(WindowRecord &record) {
+  std::string *outputs[3] = {&record.contigs, &record.hits, &record.alignments};
+  std::ofstream out(m_outputs.spillPath(record.window), std::ios::binary);
+  for (int f = 0; f < 3; f++) {
+    out << *outputs[f];
+    std::string().swap(*outputs[f]);
+  }
+  out.close();
+  if (!out)
+    throw std::runtime_error("Could not spill the outputs of window " + record.name);
+}
+
+void WindowWriter::unspill(WindowRecord &record, const size_t sizes[3]) {
+  std::string *outputs[3] = {&record.contigs, &record.hits, &record.alignments};
+  std::string path = m_outputs.spillPath(record.window);
+  std::ifstream in(path, std::ios::binary);
+  for (int f = 0; f < 3; f++) {
+    outputs[f]->resize(sizes[f]);
+    if (sizes[f] > 0)
+      in.read(&(*outputs[f])[0], sizes[f]);
+  }
+  if (!in)
+    throw std::runtime_error("Could not read back the outputs of window " + record.name);
+  in.close();
+  std::remove(path.c_str());
+}
+
+void WindowWriter::commit(std::vector<PendingRecord> &batch, size_t begin, size_t end) {
+  std::vector<WindowRecord> records;
+  // the time of the write is shared by its windows
+  WindowStats timing;
+  {
+    StageTimer timer(timing, STAGE_OUTPUT);
+    for (size_t i = begin; i < end; i++) {
+      if (batch[i].spilled)
+        unspill(batch[i].record, batch[i].sizes);
+      records.push_back(std::move(batch[i].record));
+    }
+    m_outputs.commit(records);
+  }
+  if (!m_stats)
+    return;
+  for (size_t i = begin; i < end; i++) {
+    if (!batch[i].has_stats)
+      continue;
+    batch[i].stats.addShare(STAGE_OUTPUT, timing.stages[STAGE_OUTPUT], end - begin);
+    batch[i].stats.write(*m_stats, records[i - begin].name, batch[i].thread_id);
+  }
+  m_stats->flush();
+}
+
+void WindowWriter::run() {
+  std::vector<PendingRecord> batch;
+  std::unique_lock<std::mutex> lock(m_mutex);
+  while (m_next < m_windows.size()) {
+    m_ready.wait(lock, [this] {
+      size_t w = m_windows[m_next];
+      return m_finishing || m_pending.count(w) > 0 || m_skipped.count(w) > 0;
+    });
+
+    // the windows that are next in order, or all the ones left at the end
+    batch.clear();
+    while (m_next < m_windows.size()) {
+      auto it = m_pending.find(m_windows[m_next]);
+      if (it != m_pending.end()) {
+        if (!it->second.spilled)
+          m_pending_bytes -= bytes(it->second.record);
+        batch.push_back(std::move(it->second));
+        m_pending.erase(it);
+      } else if (m_skipped.erase(m_windows[m_next]) == 0 && !m_finishing) {
+        break;
+      }
+      m_next++;
+    }
+
+    lock.unlock();
+    try {
+      // spilled outputs are read back max_pending_bytes at a time
+      size_t begin = 0, batch_bytes = 0;
+      for (size_t i = 0; i < batch.size(); i++) {
+        batch_bytes += batch[i].sizes[0] + batch[i].sizes[1] + batch[i].sizes[2];
+        if (batch_bytes > m_max_pending_bytes || i + 1 == batch.size()) {
+          commit(batch, begin, i + 1);
+          begin = i + 1;
+          batch_bytes = 0;
+        }
+      }
+    } catch (...) {
+      lock.lock();
+      m_error = std::current_exception();
+      m_pending.clear();
+      return;
+    }
+    lock.lock();
+  }
+}
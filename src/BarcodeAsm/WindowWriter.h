@@ -0,0 +1,86 @@
+#ifndef WINDOW_WRITER_H
+#define WINDOW_WRITER_H
+
+#include "WindowOutputs.h"
+#include "WindowStats.h"
+#include <condition_variable>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+class WindowWriter {
+  /* Writes the outputs of the windows in window order, from a thread of its
+     own. Workers hand over the buffered outputs of a window and carry on;
+     the writer commits the windows that are next in order as one batch, so
+     the outputs and the journal are in BED order whatever the number of
+     threads, and a resumed run appends to them in order.
+
+     Windows that finish ahead of their turn wait in memory, up to
+     max_pending_bytes of outputs. Past it, the outputs of the windows that
+     are not next are spilled to a file of the output directory, and read
+     back when their turn comes, so that windows can run in any order. A
+     window that failed is skipped, and windows that never arrive, like the
+     ones of a failed barcode scan, are skipped at the end. Both are left out
+     of the journal to be run again on resume.
+
+     With a stats file, the stats line of a window is written once the window
+     is journaled, so that a window run again on resume has a single line.
+     STAGE_OUTPUT is the time spent spilling the outputs of the window and a
+     share of the time of the write that committed it.
+  */
+
+public:
+  // windows holds the windows to be written, in increasing order.
+  // stats receives the stats lines of the windows, if not NULL.
+  WindowWriter(WindowOutputs &outputs, const std::vector<size_t> &windows,
+               size_t max_pending_bytes, std::ostream *stats = NULL);
+  ~WindowWriter();
+
+  // stats: the stats of the window to write, if any, run by thread_id.
+  void submit(WindowRecord record, const WindowStats *stats = NULL, int thread_id = 0);
+  // Passes over a window that failed, unless its outputs were submitted.
+  void skip(size_t window);
+  // Writes the windows left, and rethrows the error of a failed write.
+  void finish();
+
+  // outputs held in memory by default
+  static const size_t MAX_PENDING_BYTES = 256 << 20;
+
+private:
+  /* Outputs of a window waiting for its turn */
+  struct PendingRecord {
+    WindowRecord record;
+    bool spilled;  // the outputs are in the spill file of the window
+    size_t sizes[3];
+    bool has_stats;
+    WindowStats stats;
+    int thread_id;
+  };
+
+  void run();
+  // Commits batch[begin, end), and writes their stats lines.
+  void commit(std::vector<PendingRecord> &batch, size_t begin, size_t end);
+  // Moves the outputs of a record to its spill file, and back.
+  void spill(WindowRecord &record);
+  void unspill(WindowRecord &record, const size_t sizes[3]);
+  static size_t bytes(const WindowRecord &record);
+
+  WindowOutputs &m_outputs;
+  std::vector<size_t> m_windows;
+  size_t m_max_pending_bytes;
+  std::ostream *m_stats;
+  size_t m_pending_bytes; // outputs of m_pending held in memory
+  size_t m_next;  // position in m_windows of the next window to write
+  std::unordered_map<size_t, PendingRecord> m_pending;
+  std::unordered_set<size_t> m_skipped;
+  bool m_finishing;
+  std::exception_ptr m_error;
+  std::mutex m_mutex;
+  std::condition_variable m_ready;
+  std::thread m_thread;
+};
+
+#endif
@@ -0,0 +1,88 @@
+// The minimap2 and banded backends both align a contig with a simple insertion
+// over the insertion, on the same strand and spans.
+#include "AlignmentContext.h"
+#include "LocalAlignment.h"
+#include "ReferenceGenome.h"
+#include "TestUtil.h"
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <string>
+
+namespace {
+
+// The first alignments.tsv row of a contig
+struct AlignmentRow {
+  long target_start = -1;
+  long target_end = -1;
+  long query_start = -1;
+  long query_end = -1;
+  std::string strand;
+  std::string cigar;
+};
+
+AlignmentRow firstRow(const ReferenceGenome &genome, const SeqLib::UnalignedSequenceVector &contigs,
+                      LocalAligner aligner, std::string &rows) {
+  AlignmentContext context;
+  LocalAlignment alignment("chr1", 0, 5999, genome, context, aligner);
+  alignment.align(contigs, context);
+  std::ostringstream out;
+  alignment.writeAlignments(out);
+  rows = out.str();
+
+  AlignmentRow row;
+  std::istringstream in(rows);
+  std::string target_name, query_name;
+  long target_length, query_length, hit;
+  in >> target_name >> target_length >> row.target_start >> row.target_end >> query_name >>
+      query_length >> row.query_start >> row.query_end >> hit >> row.strand >> row.cigar;
+  return row;
+}
+
+bool near(long value, long expected) { return std::labs(value - expected) <= 10; }
+
+} // namespace
+
+int main() {
+  uint64_t state = 42;
+  std::string reference = randomBases(6000, state);
+  const char *fasta_path = "AlignerTest.fa";
+  {
+    std::ofstream fasta(fasta_path);
+    fasta << ">chr1\n";
+    for (size_t i = 0; i < reference.size(); i += 60)
+      fasta << reference.substr(i, 60) << "\n";
+  }
+  ReferenceGenome genome;
+  if (!genome.load(fasta_path)) {
+    std::cerr << "Could not load " << fasta_path << std::endl;
+    return 1;
+  }
+
+  // 2 kb of the window, a 100 bp insertion, and 1.5 kb more
+  std::string insertion = randomBases(100, state);
+  SeqLib::UnalignedSequenceVector contigs;
+  contigs.push_back(SeqLib::UnalignedSequence(
+      "insertion", reference.substr(1000, 2000) + insertion + reference.substr(3000, 1500)));
+
+  std::string minimap2_rows, banded_rows;
+  AlignmentRow minimap2 = firstRow(genome, contigs, ALIGNER_MINIMAP2, minimap2_rows);
+  AlignmentRow banded = firstRow(genome, contigs, ALIGNER_BANDED, banded_rows);
+  std::remove(fasta_path);
+  std::remove((std::string(fasta_path) + ".fai").c_str());
+
+  for (const AlignmentRow *row : {&minimap2, &banded}) {
+    std::string name = row == &minimap2 ? "minimap2" : "banded";
+    check(row->strand == "+", name + " aligns the contig forward");
+    check(row->cigar.find("100I") != std::string::npos, name + " has the insertion");
+    check(near(row->query_start, 0) && near(row->query_end, 3600), name + " aligns the whole contig");
+    check(near(row->target_end - row->target_start, 3500), name + " spans 3.5 kb of the window");
+  }
+  check(near(banded.target_start, minimap2.target_start) &&
+            near(banded.target_end, minimap2.target_end),
+        "both backends align to the same place");
+  if (failures() > 0)
+    std::cerr << "minimap2:\n" << minimap2_rows << "banded:\n" << banded_rows;
+  return checkResult("Aligner");
+}
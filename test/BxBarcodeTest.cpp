@@ -0,0 +1,74 @@
+// Packed barcode keys are distinct, never collide with hashed ones, and the
+// barcode table finds them all as it grows.
+#include "BxBarcode.h"
+#include "TestUtil.h"
+#include <set>
+#include <string>
+#include <vector>
+
+namespace {
+
+bool isHashed(BxBarcodeId id) { return (id >> 63) != 0; }
+
+} // namespace
+
+int main() {
+  // 10x barcodes pack, "-" and "_" are the same separator
+  BxBarcodeId id = packBarcode("AAACCTGAGAAACCAT-1");
+  check(!isHashed(id), "10x barcode is packed");
+  check(id == packBarcode("AAACCTGAGAAACCAT_1"), "- and _ pack alike");
+  check(id != packBarcode("AAACCTGAGAAACCAT-2"), "GEM groups differ");
+  check(id != packBarcode("AAACCTGAGAAACCAT"), "suffix differs from none");
+
+  // leading A's are 0 bits, the length tells them apart
+  std::vector<std::string> packable = {"A", "AA", "AAAA", "A-1", "A-0", "AA-1",
+                                       "C", "CA", "AC", "TTTTTTTTTTTTTTTT-16777214"};
+  std::set<BxBarcodeId> packed;
+  for (const std::string &bx : packable) {
+    BxBarcodeId key = packBarcode(bx);
+    check(key != 0 && !isHashed(key), bx + " is packed");
+    packed.insert(key);
+  }
+  check(packed.size() == packable.size(), "packed keys are distinct");
+
+  // anything else is hashed, and cannot take the key of a packed barcode
+  std::vector<std::string> hashed = {"",
+                                     "N",
+                                     "acgt",
+                                     "ACGTN-1",
+                                     "ACGT-",
+                                     "ACGT-1a",
+                                     "ACGT:1",
+                                     "AAAAAAAAAAAAAAAAA",
+                                     "TTTTTTTTTTTTTTTT-16777215"};
+  for (const std::string &bx : hashed) {
+    BxBarcodeId key = packBarcode(bx);
+    check(isHashed(key), "'" + bx + "' is hashed");
+    check(packed.count(key) == 0, "'" + bx + "' does not collide with a packed key");
+  }
+  check(packBarcode("ACGTN_1") == packBarcode("ACGTN-1"), "- and _ hash alike");
+
+  // every 8-mer with a suffix, through several table growths
+  BxBarcodeTable table;
+  std::vector<BxBarcodeId> keys;
+  for (int n = 0; n < (1 << 16); n++) {
+    std::string bx;
+    for (int j = 0; j < 8; j++)
+      bx += "ACGT"[(n >> (2 * j)) & 3];
+    keys.push_back(packBarcode(bx + "-1"));
+    keys.push_back(packBarcode(bx + "N"));
+  }
+  for (size_t i = 0; i < keys.size(); i++)
+    table[keys[i]].count = (int)i;
+  check(table.size() == keys.size(), "table size");
+  for (size_t i = 0; i < keys.size(); i++) {
+    const BxBarcodeInfo *info = table.find(keys[i]);
+    if (info == NULL || info->count != (int)i) {
+      check(false, "table lookup of key " + std::to_string(i));
+      break;
+    }
+  }
+  check(table.find(packBarcode("GGGGGGGGG-1")) == NULL, "absent key is not found");
+
+  return checkResult("BxBarcode");
+}
@@ -0,0 +1,54 @@
+// The hits of a DetectionLibrary in the contigs are those of mapping every
+// library sequence, in the same order, while only the sequences with enough
+// minimizers in one contig to chain are mapped.
+#include "AlignmentContext.h"
+#include "ContigAlignment.h"
+#include "DetectionLibrary.h"
+#include "TestUtil.h"
+#include <sstream>
+#include <string>
+
+int main() {
+  uint64_t state = 5;
+  SeqLib::UnalignedSequenceVector contigs;
+  for (int c = 0; c < 20; c++)
+    contigs.push_back(SeqLib::UnalignedSequence("contig" + std::to_string(c), randomBases(2000, state)));
+
+  // Library sequences taken from the contigs, on both strands and with a few
+  // changes, among many that are found nowhere
+  SeqLib::UnalignedSequenceVector library;
+  for (int s = 0; s < 500; s++) {
+    std::string seq = randomBases(300, state);
+    if (s % 50 == 0) {
+      const std::string &contig = contigs[s / 50].Seq;
+      seq = contig.substr(nextRandom(state) % 1500, 300);
+      seq[100] = seq[100] == 'A' ? 'C' : 'A';
+      if (s % 100 == 0)
+        seq = reverseComplement(seq);
+    }
+    library.push_back(SeqLib::UnalignedSequence("lib" + std::to_string(s), seq));
+  }
+
+  ContigAlignment contig_aln(contigs, "test");
+  AlignmentContext context;
+  std::ostringstream all_hits, library_hits;
+  contig_aln.detectSequences(library, all_hits, context);
+  DetectionLibrary detect_library = ContigAlignment::indexLibrary(library);
+  contig_aln.detectSequences(detect_library, library_hits, context);
+
+  check(!all_hits.str().empty(), "library sequences taken from the contigs have hits");
+  check(library_hits.str() == all_hits.str(), "same hits as mapping all library sequences");
+  size_t candidates = detect_library.candidates(NULL, 0, 3).size();
+  check(candidates == 0, "no candidates without contigs");
+
+  std::vector<const char *> contig_seqs;
+  for (auto &c : contigs)
+    contig_seqs.push_back(c.Seq.c_str());
+  candidates = detect_library.candidates(contig_seqs.data(), contig_seqs.size(), 3).size();
+  check(candidates >= 10 && candidates < 50,
+        "only the library sequences taken from the contigs are mapped");
+  if (failures() > 0)
+    std::cerr << "all:\n" << all_hits.str() << "library:\n" << library_hits.str()
+              << candidates << " candidates" << std::endl;
+  return checkResult("Detection");
+}
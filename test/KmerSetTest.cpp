@@ -0,0 +1,54 @@
+// KmerSet finds every inserted k-mer, and only those, as it grows.
+#include "KmerFilter.h"
+#include "TestUtil.h"
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+namespace {
+
+// random 31-mers, packed at 2 bits per base
+uint64_t randomKmer(uint64_t &state) { return nextRandom(state) >> 2; }
+
+} // namespace
+
+int main() {
+  KmerSet set;
+  check(set.size() == 0 && !set.contains(0), "empty set");
+
+  // the all-A k-mer is 0, like an empty slot without the key bit
+  set.insert(0);
+  check(set.contains(0) && set.size() == 1, "all-A k-mer");
+
+  // enough k-mers to grow the table several times
+  uint64_t state = 11;
+  std::vector<uint64_t> kmers;
+  std::unordered_set<uint64_t> inserted = {0};
+  for (size_t i = 0; i < 200000; i++) {
+    uint64_t kmer = randomKmer(state);
+    kmers.push_back(kmer);
+    set.insert(kmer);
+    inserted.insert(kmer);
+  }
+  // inserting again adds nothing
+  for (uint64_t kmer : kmers)
+    set.insert(kmer);
+  check(set.size() == inserted.size(), "set size");
+
+  size_t found = 0;
+  for (uint64_t kmer : kmers)
+    found += set.contains(kmer);
+  check(found == kmers.size(), "inserted k-mers are found");
+
+  size_t absent = 0, tried = 0;
+  for (size_t i = 0; i < 200000; i++) {
+    uint64_t kmer = randomKmer(state);
+    if (inserted.count(kmer) > 0)
+      continue;
+    tried++;
+    absent += !set.contains(kmer);
+  }
+  check(absent == tried, "other k-mers are not found");
+
+  return checkResult("KmerSet");
+}
@@ -0,0 +1,72 @@
+// A read and its reverse complement have the same fingerprint, and
+// different sequences have different ones.
+#include "ReadFingerprint.h"
+#include "TestUtil.h"
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+namespace {
+
+// Unmapped read with this sequence and no qualities.
+bam1_t *makeRead(const std::string &seq) {
+  bam1_t *b = bam_init1();
+  const char name[] = "r";
+  size_t l_qname = sizeof(name);
+  size_t l_data = l_qname + (seq.size() + 1) / 2 + seq.size();
+  b->data = (uint8_t *)calloc(l_data, 1);
+  b->m_data = l_data;
+  b->l_data = l_data;
+  b->core.l_qname = l_qname;
+  b->core.l_qseq = seq.size();
+  memcpy(b->data, name, l_qname);
+  uint8_t *s = bam_get_seq(b);
+  for (size_t j = 0; j < seq.size(); j++)
+    s[j >> 1] |= seq_nt16_table[(uint8_t)seq[j]] << ((~j & 1) << 2);
+  memset(bam_get_qual(b), 0xff, seq.size());
+  return b;
+}
+
+ReadFingerprint fingerprint(const std::string &seq) {
+  bam1_t *b = makeRead(seq);
+  ReadFingerprint f = fingerprintRead(b);
+  bam_destroy1(b);
+  return f;
+}
+
+} // namespace
+
+int main() {
+  uint64_t state = 7;
+  for (size_t length : {1, 2, 101, 150, 151}) {
+    std::string seq = randomBases(length, state);
+    check(fingerprint(seq) == fingerprint(reverseComplement(seq)),
+          "reverse complement of " + seq);
+  }
+  std::string with_n = randomBases(60, state) + "NN" + randomBases(60, state);
+  check(fingerprint(with_n) == fingerprint(reverseComplement(with_n)),
+        "reverse complement with N");
+
+  // a single change, and leading A's, change the fingerprint
+  std::string seq = randomBases(150, state);
+  std::string changed = seq;
+  changed[75] = changed[75] == 'A' ? 'C' : 'A';
+  check(!(fingerprint(seq) == fingerprint(changed)), "one base changed");
+  check(!(fingerprint("AC") == fingerprint("AAC")), "leading A");
+  check(!(fingerprint("ACGN") == fingerprint("ACG")), "trailing N");
+
+  // the set keeps one of a read and its reverse complement
+  ReadFingerprintSet set;
+  const size_t reads = 20000;
+  uint64_t replay = state;
+  for (size_t i = 0; i < reads; i++)
+    check(set.insert(fingerprint(randomBases(150, state))), "new read is inserted");
+  for (size_t i = 0; i < reads; i++)
+    if (set.insert(fingerprint(reverseComplement(randomBases(150, replay))))) {
+      check(false, "reverse complement of read " + std::to_string(i) + " is a duplicate");
+      break;
+    }
+  check(set.size() == reads, "set size");
+
+  return checkResult("ReadFingerprint");
+}
@@ -0,0 +1,55 @@
+#ifndef TEST_UTIL_H
+#define TEST_UTIL_H
+
+// Helpers shared by the checks run by make check
+#include <cstdint>
+#include <iostream>
+#include <string>
+
+// checks that failed so far
+inline int &failures() {
+  static int count = 0;
+  return count;
+}
+
+inline void check(bool condition, const std::string &what) {
+  if (!condition) {
+    std::cerr << "FAILED: " << what << std::endl;
+    failures()++;
+  }
+}
+
+// Exit status of the checks, with a line once they all passed.
+inline int checkResult(const std::string &name) {
+  if (failures() == 0)
+    std::cout << name << " checks passed" << std::endl;
+  return failures() == 0 ? 0 : 1;
+}
+
+// Reproducible random numbers, from a 64 bit LCG. The high bits are the
+// most random.
+inline uint64_t nextRandom(uint64_t &state) {
+  state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+  return state;
+}
+
+inline std::string randomBases(size_t length, uint64_t &state) {
+  std::string bases(length, 'A');
+  for (size_t i = 0; i < length; i++)
+    bases[i] = "ACGT"[nextRandom(state) >> 62];
+  return bases;
+}
+
+inline std::string reverseComplement(const std::string &seq) {
+  std::string rc(seq.rbegin(), seq.rend());
+  for (char &c : rc)
+    switch (c) {
+    case 'A': c = 'T'; break;
+    case 'C': c = 'G'; break;
+    case 'G': c = 'C'; break;
+    case 'T': c = 'A'; break;
+    }
+  return rc;
+}
+
+#endif